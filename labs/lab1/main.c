@@ -1,79 +1,392 @@
 #include <assert.h>
-#include <ctype.h>
+#include <dirent.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include <labs_random.h>
 
-static char* read_sample_data(const char* filename) {
-    FILE* f = fopen(filename, "r");
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char* data = (char*)malloc(len+1);
-    fread(data, 1, len, f);
-    fclose(f);
+// copies letters from src to dst lowercasing them, returns number of letters
+// written. dst must have room for len bytes, dst == src is allowed
+static size_t compact_letters(char* dst, const char* src, size_t len) {
+    size_t i = 0;
     size_t j = 0;
-    for (size_t i = 0; i < len; i++) {
-        if ('a' <= data[i] && data[i] <= 'z') {
-            data[j++] = data[i];
-        } else if ('A' <= data[i] && data[i] <= 'Z'){
-            data[j++] = tolower(data[i]);
+#if defined(__AVX2__) && defined(__BMI2__)
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    for (; i + 32 <= len; i += 32) {
+        // bytes >= 0x80 are negative and fail the signed compare
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(src + i)), case_bit);
+        __m256i is_letter = _mm256_and_si256(_mm256_cmpgt_epi8(v, before_a), _mm256_cmpgt_epi8(after_z, v));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(is_letter);
+        if (mask == 0) continue;
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, v);
+        // compress each 8 byte lane, stores never pass the bytes already loaded
+        for (size_t k = 0; k < 4; k++) {
+            uint64_t lane_mask = mask >> (8 * k) & 0xFF;
+            uint64_t packed = _pext_u64(lanes[k], _pdep_u64(lane_mask, 0x0101010101010101) * 0xFF);
+            memcpy(dst + j, &packed, 8);
+            j += (size_t)__builtin_popcountll(lane_mask);
         }
     }
-    data[j] = 0;
-    return data;
+#endif
+    for (; i < len; i++) {
+        char c = src[i] | 0x20;
+        dst[j] = c;
+        j += 'a' <= c && c <= 'z';
+    }
+    return j;
 }
 
-void encrypt(const char* key, char* message) {
-    size_t key_len = strlen(key);
-    size_t msg_len = strlen(message);
-    for (size_t i = 0; i < msg_len; i++) {
-        message[i] = 'a' + ((int)key[i % key_len] + (int)message[i] - 2 * 'a') % 26;
+// lowercase letters of the input file, everything else is dropped.
+//
+// Large regular files are mapped and compacted into an anonymous mapping of the
+// same size, of which only the pages holding the compacted text are ever
+// touched (and the rest is unmapped afterwards). Other inputs ("-" is stdin) are
+// read in READ_CHUNK_LEN chunks and compacted as they arrive, reusing the heap
+// buffer left from the previous call. data[len] is 0 whenever capacity allows.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity; // heap buffer size or mapping length
+    bool mapped;
+} SampleData;
+
+#define READ_CHUNK_LEN (1<<16)
+#define MMAP_MIN_LEN (1<<20)
+
+void free_sample_data(SampleData* sample) {
+    if (sample->mapped) {
+        munmap(sample->data, sample->capacity);
+    } else {
+        free(sample->data);
+    }
+    memset(sample, 0, sizeof(SampleData));
+}
+
+static bool map_sample_data(int fd, size_t file_len, SampleData* sample) {
+    char* input = (char*)mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (input == MAP_FAILED) return false;
+    // only the pages the compacted text ends up in get touched
+    char* data = (char*)mmap(NULL, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        munmap(input, file_len);
+        return false;
+    }
+    madvise(input, file_len, MADV_SEQUENTIAL);
+    free_sample_data(sample);
+    sample->data = data;
+    sample->len = compact_letters(data, input, file_len);
+    sample->capacity = file_len;
+    sample->mapped = true;
+    munmap(input, file_len);
+    // give back the pages past the compacted text
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (sample->len + page) & ~(page - 1);
+    if (keep < file_len) {
+        munmap(data + keep, file_len - keep);
+        sample->capacity = keep;
+    }
+    if (sample->len < sample->capacity) {
+        sample->data[sample->len] = 0;
+    }
+    return true;
+}
+
+static bool reserve_sample_data(SampleData* sample, size_t capacity) {
+    if (capacity <= sample->capacity) return true;
+    if (capacity < 2 * sample->capacity) {
+        capacity = 2 * sample->capacity;
+    }
+    char* data = (char*)realloc(sample->data, capacity);
+    if (data == NULL) return false;
+    sample->data = data;
+    sample->capacity = capacity;
+    return true;
+}
+
+// the whole file as is, mapped privately when large so it can be changed in place
+static bool map_raw_data(int fd, size_t file_len, SampleData* sample) {
+    char* data = (char*)mmap(NULL, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+    madvise(data, file_len, MADV_SEQUENTIAL);
+    free_sample_data(sample);
+    sample->data = data;
+    sample->len = file_len;
+    sample->capacity = file_len;
+    sample->mapped = true;
+    return true;
+}
+
+static bool load_data(const char* filename, SampleData* sample, bool letters_only) {
+    bool from_stdin = strcmp(filename, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    size_t hint = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        hint = (size_t)st.st_size;
+        bool mapped = hint >= MMAP_MIN_LEN &&
+            (letters_only ? map_sample_data(fd, hint, sample) : map_raw_data(fd, hint, sample));
+        if (mapped) {
+            if (!from_stdin) close(fd);
+            return true;
+        }
+    }
+
+    if (sample->mapped) {
+        free_sample_data(sample);
     }
+    sample->len = 0;
+    bool ok = reserve_sample_data(sample, (hint > READ_CHUNK_LEN ? hint : READ_CHUNK_LEN) + 1);
+    while (ok) {
+        ok = reserve_sample_data(sample, sample->len + READ_CHUNK_LEN + 1);
+        if (!ok) break;
+        char* tail = sample->data + sample->len;
+        ssize_t n = read(fd, tail, READ_CHUNK_LEN);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        sample->len += letters_only ? compact_letters(tail, tail, (size_t)n) : (size_t)n;
+    }
+    if (!from_stdin) close(fd);
+    if (ok) {
+        sample->data[sample->len] = 0;
+    }
+    return ok;
+}
+
+bool read_sample_data(const char* filename, SampleData* sample) {
+    return load_data(filename, sample, true);
+}
+
+// same as read_sample_data but keeps every byte
+bool read_raw_data(const char* filename, SampleData* sample) {
+    return load_data(filename, sample, false);
 }
 
 #define KEY_BUF_LEN 256
-char reverse_key[KEY_BUF_LEN];
 
-void decrypt(const char* key, char* message) {
+#if defined(__AVX2__)
+#define VIGENERE_VEC_LEN 32
+#else
+#define VIGENERE_VEC_LEN 16
+#endif
+
+// key as shifts 0..25, repeated up to one vector past its end so a vector
+// load at any key phase never has to wrap around
+typedef struct {
+    size_t len;
+    uint8_t shift[KEY_BUF_LEN + VIGENERE_VEC_LEN];
+} VigenereKey;
+
+void vigenere_key_init(VigenereKey* vkey, const char* key, bool inverse) {
     size_t key_len = strlen(key);
-    assert(key_len < KEY_BUF_LEN);
-    for (size_t i = 0; i < key_len; i++) {
-        reverse_key[i] = (26 + 'a' - (int)key[i]) % 26 + 'a';
+    assert(0 < key_len && key_len < KEY_BUF_LEN);
+    vkey->len = key_len;
+    for (size_t i = 0; i < key_len + VIGENERE_VEC_LEN; i++) {
+        uint8_t shift = (uint8_t)(key[i % key_len] - 'a');
+        vkey->shift[i] = inverse ? (26 - shift) % 26 : shift;
     }
-    reverse_key[key_len] = 0;
-    encrypt(reverse_key, message);
 }
 
-// https://en.wikipedia.org/wiki/Index_of_coincidence
-static double compute_ic_impl(const char* text, size_t offset, size_t stride) {
-    unsigned freq[26];
-    memset(freq, 0, sizeof (unsigned) * 26);
-    size_t len = strlen(text);
-    for (size_t i = offset; i < len; i += stride) {
-        freq[text[i] - 'a'] += 1;
+// shifts letters of message in place by the key, message[0] gets key[0]
+void vigenere_apply(const VigenereKey* vkey, char* message, size_t len) {
+    size_t i = 0;
+    size_t phase = 0;
+    size_t step = VIGENERE_VEC_LEN % vkey->len;
+    // (m + k) mod 26 as min(s, s - 26): s - 26 wraps above s when s < 26
+#if defined(__AVX2__)
+    const __m256i a = _mm256_set1_epi8('a');
+    const __m256i n = _mm256_set1_epi8(26);
+    for (; i + 32 <= len; i += 32) {
+        __m256i m = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(message + i)), a);
+        __m256i s = _mm256_add_epi8(m, _mm256_loadu_si256((const __m256i*)(vkey->shift + phase)));
+        s = _mm256_min_epu8(s, _mm256_sub_epi8(s, n));
+        _mm256_storeu_si256((__m256i*)(message + i), _mm256_add_epi8(s, a));
+        phase += step;
+        if (phase >= vkey->len) phase -= vkey->len;
     }
-    double ic = 0.;
-    size_t count = (len - offset) / stride;
+#elif defined(__SSE2__)
+    const __m128i a = _mm_set1_epi8('a');
+    const __m128i n = _mm_set1_epi8(26);
+    for (; i + 16 <= len; i += 16) {
+        __m128i m = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(message + i)), a);
+        __m128i s = _mm_add_epi8(m, _mm_loadu_si128((const __m128i*)(vkey->shift + phase)));
+        s = _mm_min_epu8(s, _mm_sub_epi8(s, n));
+        _mm_storeu_si128((__m128i*)(message + i), _mm_add_epi8(s, a));
+        phase += step;
+        if (phase >= vkey->len) phase -= vkey->len;
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned s = (unsigned)(message[i] - 'a') + vkey->shift[phase];
+        if (s >= 26) s -= 26;
+        message[i] = 'a' + (char)s;
+        if (++phase == vkey->len) phase = 0;
+    }
+}
+
+void encrypt(const char* key, char* message, size_t msg_len) {
+    VigenereKey vkey;
+    vigenere_key_init(&vkey, key, false);
+    vigenere_apply(&vkey, message, msg_len);
+}
+
+void decrypt(const char* key, char* message, size_t msg_len) {
+    VigenereKey vkey;
+    vigenere_key_init(&vkey, key, true);
+    vigenere_apply(&vkey, message, msg_len);
+}
+
+// adds letters of `text` to per-column histograms of the given stride
+// (26 counters per column), `column` is the column of text[0]
+static void accumulate_columns(uint32_t* freq, size_t stride, size_t column, const char* text, size_t len) {
+    size_t i = 0;
+    // finish the partial row
+    for (; i < len && column != 0; i++) {
+        freq[column * 26 + text[i] - 'a'] += 1;
+        if (++column == stride) column = 0;
+    }
+    // full rows
+    for (; i + stride <= len; i += stride) {
+        uint32_t* f = freq;
+        for (size_t j = 0; j < stride; j++, f += 26) {
+            f[text[i + j] - 'a'] += 1;
+        }
+    }
+    // tail
+    for (size_t j = 0; i < len; i++, j++) {
+        freq[j * 26 + text[i] - 'a'] += 1;
+    }
+}
+
+// https://en.wikipedia.org/wiki/Index_of_coincidence
+static double column_ic(const uint32_t* freq) {
+    uint64_t count = 0;
+    uint64_t pairs = 0;
     for (size_t i = 0; i < 26; i++) {
-        ic += (double)(freq[i] * (freq[i] - 1)) / (double)(count * (count - 1));
+        count += freq[i];
+        pairs += (uint64_t)freq[i] * (freq[i] - 1);
     }
-    return ic * 26.;
+    if (count < 2) return 0.;
+    return 26. * (double)pairs / (double)(count * (count - 1));
 }
 
-double compute_ic(const char* text, size_t stride) {
+static double columns_ic(const uint32_t* freq, size_t stride) {
     double ic = 0.;
     for (size_t i = 0; i < stride; i++) {
-        ic += compute_ic_impl(text, i, stride);
+        ic += column_ic(&freq[i * 26]);
     }
     return ic / (double)stride;
 }
 
+double compute_ic(const char* text, size_t len, size_t stride) {
+    assert(stride < KEY_BUF_LEN);
+    uint32_t freq[KEY_BUF_LEN * 26];
+    memset(freq, 0, sizeof(uint32_t) * 26 * stride);
+    accumulate_columns(freq, stride, 0, text, len);
+    return columns_ic(freq, stride);
+}
+
+// IC-vs-key-length curve
+//
+// Holds per-column letter histograms for every stride 1..max_stride. All of
+// them are filled in a single pass over the text: the text is walked in
+// IC_BLOCK_LEN blocks and every stride consumes the block while it is still
+// in cache. Stride k owns k columns of 26 counters at freq[26 * k*(k-1)/2].
+// Counters are 32-bit, so the text must be shorter than 4G letters.
+
+#define IC_BLOCK_LEN (1<<16)
+
+typedef struct {
+    size_t max_stride;
+    size_t text_len;
+    uint32_t* freq;
+    double ic[KEY_BUF_LEN];
+} IcCurve;
+
+static size_t ic_curve_freq_offset(size_t stride) {
+    return 26 * (stride * (stride - 1) / 2);
+}
+
+// false when out of memory, the curve needs no ic_curve_free then
+bool ic_curve_init(IcCurve* curve, size_t max_stride) {
+    assert(max_stride < KEY_BUF_LEN);
+    curve->max_stride = max_stride;
+    curve->text_len = 0;
+    curve->freq = (uint32_t*)malloc(sizeof(uint32_t) * ic_curve_freq_offset(max_stride + 1));
+    memset(curve->ic, 0, sizeof(curve->ic));
+    return curve->freq != NULL;
+}
+
+void ic_curve_free(IcCurve* curve) {
+    free(curve->freq);
+    curve->freq = NULL;
+}
+
+// histogram of the given column for the given stride
+const uint32_t* ic_curve_column(const IcCurve* curve, size_t stride, size_t column) {
+    assert(1 <= stride && stride <= curve->max_stride && column < stride);
+    return &curve->freq[ic_curve_freq_offset(stride) + column * 26];
+}
+
+// fills histograms and IC values of strides first..last only
+void ic_curve_build_range(IcCurve* curve, const char* text, size_t len, size_t first, size_t last) {
+    assert(len <= UINT32_MAX);
+    assert(1 <= first && last <= curve->max_stride);
+    if (first > last) return;
+    size_t begin = ic_curve_freq_offset(first);
+    memset(&curve->freq[begin], 0, sizeof(uint32_t) * (ic_curve_freq_offset(last + 1) - begin));
+    for (size_t block = 0; block < len; block += IC_BLOCK_LEN) {
+        size_t n = len - block < IC_BLOCK_LEN ? len - block : IC_BLOCK_LEN;
+        for (size_t k = first; k <= last; k++) {
+            uint32_t* freq = &curve->freq[ic_curve_freq_offset(k)];
+            accumulate_columns(freq, k, block % k, text + block, n);
+        }
+    }
+    curve->text_len = len;
+    for (size_t k = first; k <= last; k++) {
+        curve->ic[k] = columns_ic(&curve->freq[ic_curve_freq_offset(k)], k);
+    }
+}
+
+void ic_curve_build(IcCurve* curve, const char* text, size_t len) {
+    ic_curve_build_range(curve, text, len, 1, curve->max_stride);
+}
+
+// first key length whose IC exceeds the threshold (0 if there is none)
+size_t ic_curve_key_len(const IcCurve* curve, double threshold) {
+    for (size_t k = 1; k <= curve->max_stride; k++) {
+        if (curve->ic[k] > threshold) return k;
+    }
+    return 0;
+}
+
 // https://en.wikipedia.org/wiki/Pearson%27s_chi-squared_test
-double chi_squared_test(size_t n, const double* p, const double* x, unsigned samples) {
+double chi_squared_test(size_t n, const double* p, const double* x, double samples) {
     double chisqr = 0;
     for (size_t i = 0; i < n; i++) {
-        double expected = (double)samples * p[i];
+        double expected = samples * p[i];
         double diff = x[i] - expected;
         chisqr += diff * diff / expected;
     }
@@ -86,14 +399,245 @@ static const double expected_freq[26] = {
     0.08167, 0.01492, 0.02782, 0.04253, 0.12702, 0.02228, 0.02015, 0.06094, 0.06966, 0.00153, 0.00772, 0.04025, 0.02406, 0.06749, 0.07507, 0.01929, 0.00095, 0.05987, 0.06327, 0.09056, 0.02758, 0.00978, 0.02360, 0.00150, 0.01974, 0.00074
 };
 
-char break_caesar(const char* text, size_t offset, size_t stride) {
-    unsigned freq[26];
-    memset(freq, 0, sizeof (unsigned) * 26);
-    size_t len = strlen(text);
-    for (size_t i = offset; i < len; i += stride) {
-        freq[text[i] - 'a'] += 1;
+// letter frequencies the crackers score against, use_language_model swaps in
+// the ones of a loaded model before any worker starts
+static const double* letter_freq = expected_freq;
+
+// Kasiski examination
+// https://en.wikipedia.org/wiki/Kasiski_examination
+//
+// A repeated ciphertext n-gram is most likely the same plaintext n-gram under
+// the same key phase, so distances between repeats tend to be multiples of the
+// key length. One pass over the text records the gap to the previous
+// occurrence of every n-gram (n-grams live in an open addressing table), then
+// every candidate length d scores the share of gaps it divides minus the 1/d
+// share random gaps would give. The score peaks at the key length: its
+// divisors score a bit less, its m-th multiples only 1/m of it. The largest
+// length scoring close to the peak wins.
+
+#define KASISKI_NGRAM 4
+#define KASISKI_NGRAM_COUNT (26*26*26*26)
+#define KASISKI_MAX_GAP (1<<16)
+#define KASISKI_MIN_GAPS 16
+#define KASISKI_MIN_SCORE 0.05
+#define KASISKI_SCORE_RATIO 0.9
+// above this the guess is kept even when its IC stays under IC_THRESHOLD,
+// which happens on short texts
+#define KASISKI_SURE_SCORE 0.5
+
+typedef struct {
+    uint32_t gram; // n-gram index + 1, 0 marks an empty slot
+    uint32_t last; // position of its previous occurrence
+} NgramSlot;
+
+typedef struct {
+    NgramSlot* slots;
+    size_t capacity; // power of two
+    uint32_t* gaps; // gap histogram, gaps >= KASISKI_MAX_GAP are dropped
+    double score[KEY_BUF_LEN];
+} KasiskiIndex;
+
+// without memory for the gap histogram kasiski_key_len never guesses
+void kasiski_init(KasiskiIndex* index) {
+    index->slots = NULL;
+    index->capacity = 0;
+    index->gaps = (uint32_t*)malloc(sizeof(uint32_t) * KASISKI_MAX_GAP);
+    memset(index->score, 0, sizeof(index->score));
+}
+
+void kasiski_free(KasiskiIndex* index) {
+    free(index->slots);
+    free(index->gaps);
+    memset(index, 0, sizeof(KasiskiIndex));
+}
+
+static uint32_t ngram_hash(uint32_t gram) {
+    return gram * 0x9E3779B1u;
+}
+
+// fills index->score and returns the most likely key length (0 if the text
+// doesn't repeat enough to tell, or there is no memory for the tables)
+size_t kasiski_key_len(KasiskiIndex* index, const char* text, size_t len) {
+    assert(len <= UINT32_MAX);
+    memset(index->score, 0, sizeof(index->score));
+    if (len < KASISKI_NGRAM || index->gaps == NULL) return 0;
+
+    // keep the table at most half full
+    size_t distinct = len < KASISKI_NGRAM_COUNT ? len : KASISKI_NGRAM_COUNT;
+    size_t capacity = 1;
+    while (capacity < 2 * distinct) capacity <<= 1;
+    if (capacity > index->capacity) {
+        free(index->slots);
+        index->slots = (NgramSlot*)malloc(sizeof(NgramSlot) * capacity);
+        index->capacity = index->slots != NULL ? capacity : 0;
+        if (index->slots == NULL) return 0;
+    }
+    memset(index->slots, 0, sizeof(NgramSlot) * capacity);
+    memset(index->gaps, 0, sizeof(uint32_t) * KASISKI_MAX_GAP);
+    size_t mask = capacity - 1;
+    unsigned shift = 32 - (unsigned)__builtin_ctzll(capacity);
+
+    uint32_t gram = 0;
+    for (size_t i = 0; i < KASISKI_NGRAM - 1; i++) {
+        gram = gram * 26 + (uint32_t)(text[i] - 'a');
+    }
+    size_t total = 0;
+    for (size_t i = KASISKI_NGRAM - 1; i < len; i++) {
+        gram = (gram * 26 + (uint32_t)(text[i] - 'a')) % KASISKI_NGRAM_COUNT;
+        uint32_t pos = (uint32_t)(i + 1 - KASISKI_NGRAM);
+        size_t j = capacity == 1 ? 0 : ngram_hash(gram) >> shift;
+        while (index->slots[j].gram != 0 && index->slots[j].gram != gram + 1) {
+            j = (j + 1) & mask;
+        }
+        NgramSlot* slot = &index->slots[j];
+        if (slot->gram != 0) {
+            uint32_t gap = pos - slot->last;
+            if (gap < KASISKI_MAX_GAP) {
+                index->gaps[gap] += 1;
+                total += 1;
+            }
+        }
+        slot->gram = gram + 1;
+        slot->last = pos;
+    }
+    if (total < KASISKI_MIN_GAPS) return 0;
+
+    // length 1 divides every gap, so Kasiski can't see it
+    double best = 0.;
+    for (size_t d = 2; d < KEY_BUF_LEN; d++) {
+        uint64_t votes = 0;
+        for (size_t g = d; g < KASISKI_MAX_GAP; g += d) {
+            votes += index->gaps[g];
+        }
+        index->score[d] = (double)votes / (double)total - 1. / (double)d;
+        if (index->score[d] > best) best = index->score[d];
+    }
+    if (best < KASISKI_MIN_SCORE) return 0;
+    for (size_t d = KEY_BUF_LEN - 1; d >= 2; d--) {
+        if (index->score[d] >= KASISKI_SCORE_RATIO * best) return d;
+    }
+    return 0;
+}
+
+// Autocorrelation
+//
+// Coincidence counts of the text with itself shifted by every d up to
+// KEY_BUF_LEN-1: shifts that are multiples of the key length agree as often as
+// plaintext does, the others barely more than random letters. The letters are
+// packed into 5 bit planes, a word of each holds 64 positions, and two
+// positions agree when none of their planes differ, so one popcount counts 64
+// pairs. The planes are walked in blocks that stay in L1 across all shifts.
+
+#define AUTOCORR_PLANES 5
+#define AUTOCORR_BLOCK_WORDS 512
+// enough for the key length, the columns are solved on the whole text
+#define AUTOCORR_SAMPLE (1<<20)
+// key length multiples keep the plaintext coincidence rate, other shifts drop
+#define AUTOCORR_KEY_LEN_RATIO 0.75
+
+// words of each plane for len letters, with two zero words past the text for
+// the shifted reads
+static size_t autocorrelation_plane_words(size_t len) {
+    return (len + 63) / 64 + 2;
+}
+
+// planes for up to AUTOCORR_SAMPLE letters, as autocorrelation_key_len takes
+uint64_t* autocorrelation_planes_alloc() {
+    return (uint64_t*)malloc(sizeof(uint64_t) * AUTOCORR_PLANES * autocorrelation_plane_words(AUTOCORR_SAMPLE));
+}
+
+static void autocorrelation_pack(uint64_t* planes, size_t words, const char* text, size_t len) {
+    memset(planes, 0, sizeof(uint64_t) * AUTOCORR_PLANES * words);
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(text + i)), _mm256_set1_epi8('a'));
+        __m256i hi = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)(text + i + 32)), _mm256_set1_epi8('a'));
+        for (size_t p = 0; p < AUTOCORR_PLANES; p++) {
+            // bit p of every byte to its top bit, 16-bit shifts don't carry into it
+            __m128i count = _mm_cvtsi32_si128(7 - (int)p);
+            uint64_t low = (uint32_t)_mm256_movemask_epi8(_mm256_sll_epi16(lo, count));
+            uint64_t high = (uint32_t)_mm256_movemask_epi8(_mm256_sll_epi16(hi, count));
+            planes[p * words + i / 64] = low | high << 32;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        uint64_t letter = (uint64_t)(text[i] - 'a');
+        for (size_t p = 0; p < AUTOCORR_PLANES; p++) {
+            planes[p * words + i / 64] |= (letter >> p & 1) << (i % 64);
+        }
+    }
+}
+
+// bits of positions 64j.. that agree with the positions d = 64q+r further
+static inline uint64_t autocorrelation_word(const uint64_t* planes, size_t words, size_t j, size_t q, unsigned r) {
+    uint64_t diff = 0;
+    for (size_t p = 0; p < AUTOCORR_PLANES; p++) {
+        const uint64_t* plane = planes + p * words;
+        // shifting by 1 then 63-r is 64-r without undefined behaviour at r = 0
+        uint64_t shifted = plane[j + q] >> r | (plane[j + q + 1] << 1) << (63 - r);
+        diff |= plane[j] ^ shifted;
+    }
+    return ~diff;
+}
+
+// counts[d] = #{i : text[i] == text[i+d]} for d in 1..max_shift, planes
+// holds AUTOCORR_PLANES * autocorrelation_plane_words(len) words
+void letter_autocorrelation(uint64_t* planes, const char* text, size_t len, size_t max_shift, uint64_t* counts) {
+    memset(counts, 0, sizeof(uint64_t) * (max_shift + 1));
+    size_t words = autocorrelation_plane_words(len);
+    autocorrelation_pack(planes, words, text, len);
+    for (size_t block = 0; block * 64 < len; block += AUTOCORR_BLOCK_WORDS) {
+        for (size_t d = 1; d <= max_shift && d < len; d++) {
+            // pairs (i, i+d) with i < len-d, the word holding the last ones is partial
+            size_t pairs = len - d;
+            size_t full = pairs / 64;
+            size_t end = block + AUTOCORR_BLOCK_WORDS < full ? block + AUTOCORR_BLOCK_WORDS : full;
+            size_t q = d / 64;
+            unsigned r = (unsigned)(d % 64);
+            uint64_t count = 0;
+            for (size_t j = block; j < end; j++) {
+                count += (uint64_t)__builtin_popcountll(autocorrelation_word(planes, words, j, q, r));
+            }
+            if (block <= full && full < block + AUTOCORR_BLOCK_WORDS && pairs % 64 != 0) {
+                uint64_t tail = ((uint64_t)1 << (pairs % 64)) - 1;
+                count += (uint64_t)__builtin_popcountll(autocorrelation_word(planes, words, full, q, r) & tail);
+            }
+            counts[d] += count;
+        }
+    }
+}
+
+// fills rate[1..KEY_BUF_LEN-1] with the autocorrelation spectrum (coincidences
+// per pair, 0 for shifts too long for the text) and returns the first shift
+// near its peak, 0 if the text is too short. planes come from
+// autocorrelation_planes_alloc
+size_t autocorrelation_key_len(uint64_t* planes, const char* text, size_t len, double* rate) {
+    memset(rate, 0, sizeof(double) * KEY_BUF_LEN);
+    size_t n = len < AUTOCORR_SAMPLE ? len : AUTOCORR_SAMPLE;
+    size_t max_shift = KEY_BUF_LEN - 1 < n / 2 ? KEY_BUF_LEN - 1 : n / 2;
+    uint64_t counts[KEY_BUF_LEN];
+    if (max_shift == 0) return 0;
+    letter_autocorrelation(planes, text, n, max_shift, counts);
+    double best = 0.;
+    for (size_t d = 1; d <= max_shift; d++) {
+        rate[d] = (double)counts[d] / (double)(n - d);
+        if (rate[d] > best) best = rate[d];
+    }
+    for (size_t d = 1; d <= max_shift; d++) {
+        if (rate[d] >= AUTOCORR_KEY_LEN_RATIO * best) return d;
+    }
+    return 0;
+}
+
+// best caesar shift for a column with the given letter counts,
+// its chi-squared value goes to *chisqr_out (if not NULL)
+static size_t caesar_shift_from_counts(const double* counts, double* chisqr_out) {
+    double count = 0.;
+    for (size_t i = 0; i < 26; i++) {
+        count += counts[i];
     }
-    size_t count = (len - offset) / stride;
 
     double min_error = 1e9;
     size_t best_shift = 0;
@@ -101,58 +645,1548 @@ char break_caesar(const char* text, size_t offset, size_t stride) {
     for (size_t i = 0; i < 26; i++) {
         // compute freq for caesar subtition with offset i
         for (size_t j = 0; j < 26; j++) { 
-            x[(j + 26 - i) % 26] = (double)freq[j];
+            x[(j + 26 - i) % 26] = counts[j];
         }
 
-        double chisqr = chi_squared_test(26, expected_freq, x, count);
+        double chisqr = chi_squared_test(26, letter_freq, x, count);
         if (chisqr < min_error) {
             min_error = chisqr;
             best_shift = i;
         }
     }
+    if (chisqr_out != NULL) *chisqr_out = min_error;
+    return best_shift;
+}
+
+static size_t caesar_shift_from_freq(const uint32_t* freq, double* chisqr_out) {
+    double counts[26];
+    for (size_t i = 0; i < 26; i++) {
+        counts[i] = (double)freq[i];
+    }
+    return caesar_shift_from_counts(counts, chisqr_out);
+}
+
+char break_caesar(const char* text, size_t len, size_t offset, size_t stride) {
+    uint32_t freq[26];
+    memset(freq, 0, sizeof (uint32_t) * 26);
+    for (size_t i = offset; i < len; i += stride) {
+        freq[text[i] - 'a'] += 1;
+    }
+    return 'a' + (char)caesar_shift_from_freq(freq, NULL);
+}
+
+// fork-join worker pool, the calling thread runs worker 0
+
+#define MAX_WORKERS 64
+
+typedef void (*WorkerFn)(void* ctx, size_t worker, size_t workers);
+
+typedef struct {
+    WorkerFn fn;
+    void* ctx;
+    size_t worker;
+    size_t workers;
+} WorkerArgs;
+
+static void* worker_main(void* arg) {
+    WorkerArgs* args = (WorkerArgs*)arg;
+    args->fn(args->ctx, args->worker, args->workers);
+    return NULL;
+}
+
+static void run_workers(size_t workers, WorkerFn fn, void* ctx) {
+    assert(1 <= workers && workers <= MAX_WORKERS);
+    pthread_t threads[MAX_WORKERS];
+    WorkerArgs args[MAX_WORKERS];
+    bool started[MAX_WORKERS] = {0};
+    for (size_t i = 1; i < workers; i++) {
+        args[i] = (WorkerArgs){ fn, ctx, i, workers };
+        started[i] = pthread_create(&threads[i], NULL, worker_main, &args[i]) == 0;
+    }
+    fn(ctx, 0, workers);
+    for (size_t i = 1; i < workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            // out of threads, do its share here
+            fn(ctx, i, workers);
+        }
+    }
+}
 
-    return 'a' + (char)best_shift;
+// [*begin, *end) is the part-th of parts equal slices of [0, n)
+static void split_range(size_t n, size_t part, size_t parts, size_t* begin, size_t* end) {
+    *begin = n * part / parts;
+    *end = n * (part + 1) / parts;
 }
 
 #define IC_THRESHOLD 1.6
 
-const char* break_vigenere(const char* text) {
+typedef struct {
+    IcCurve* curve;
+    const char* text;
+    size_t len;
+    size_t strides; // of the IC curve scan
+    size_t key_len;
+    char* key;
+} VigenereJob;
+
+// every stride costs one increment per letter, so equal stride counts are equal work
+static void ic_curve_worker(void* ctx, size_t worker, size_t workers) {
+    VigenereJob* job = (VigenereJob*)ctx;
+    size_t begin, end;
+    split_range(job->strides, worker, workers, &begin, &end);
+    ic_curve_build_range(job->curve, job->text, job->len, begin + 1, end);
+}
+
+// ic_curve_build_range of strides 1..last split between `threads` workers
+void ic_curve_build_parallel(IcCurve* curve, const char* text, size_t len, size_t last, size_t threads) {
+    VigenereJob job = { curve, text, len, last, 0, NULL };
+    run_workers(threads, ic_curve_worker, &job);
+}
+
+static void key_columns_worker(void* ctx, size_t worker, size_t workers) {
+    VigenereJob* job = (VigenereJob*)ctx;
+    size_t begin, end;
+    split_range(job->key_len, worker, workers, &begin, &end);
+    for (size_t i = begin; i < end; i++) {
+        job->key[i] = 'a' + (char)caesar_shift_from_freq(ic_curve_column(job->curve, job->key_len, i), NULL);
+    }
+}
+
+// checks a key length guess against the IC threshold, one pass per divisor
+// of the guess, smallest first. A sure guess is kept even if no divisor
+// passes, otherwise 0 is returned
+static size_t confirm_key_len(IcCurve* curve, const char* text, size_t len, size_t guess, bool sure) {
+    for (size_t d = 1; d <= guess && d <= curve->max_stride; d++) {
+        if (guess % d != 0) continue;
+        ic_curve_build_range(curve, text, len, d, d);
+        if (curve->ic[d] > IC_THRESHOLD) return d;
+    }
+    return guess <= curve->max_stride && sure ? guess : 0;
+}
+
+// Kasiski, then the autocorrelation peak, each confirmed by the IC of the
+// guess. 0 when neither holds and the whole IC curve is needed. Without
+// planes (out of memory) the autocorrelation is skipped
+static size_t guess_key_len(IcCurve* curve, KasiskiIndex* kasiski, uint64_t* planes, const char* text, size_t len) {
     size_t key_len = 0;
-    while (key_len < KEY_BUF_LEN) {
-        key_len += 1;
-        double ic = compute_ic(text, key_len);
+    size_t guess = kasiski_key_len(kasiski, text, len);
+    if (guess != 0) {
+        key_len = confirm_key_len(curve, text, len, guess, kasiski->score[guess] >= KASISKI_SURE_SCORE);
+    }
+    if (key_len == 0 && planes != NULL) {
+        double rate[KEY_BUF_LEN];
+        guess = autocorrelation_key_len(planes, text, len, rate);
+        if (guess != 0) key_len = confirm_key_len(curve, text, len, guess, false);
+    }
+    return key_len;
+}
+
+typedef struct {
+    IcCurve curve;
+    KasiskiIndex kasiski;
+    uint64_t* planes; // autocorrelation
+} CrackScratch;
+
+// false when out of memory, with nothing left to free. Kasiski and the
+// autocorrelation only save IC passes, so the crack runs without their tables
+bool crack_scratch_init(CrackScratch* scratch) {
+    kasiski_init(&scratch->kasiski);
+    scratch->planes = autocorrelation_planes_alloc();
+    if (!ic_curve_init(&scratch->curve, KEY_BUF_LEN - 1)) {
+        kasiski_free(&scratch->kasiski);
+        free(scratch->planes);
+        scratch->planes = NULL;
+        return false;
+    }
+    return true;
+}
+
+void crack_scratch_free(CrackScratch* scratch) {
+    ic_curve_free(&scratch->curve);
+    kasiski_free(&scratch->kasiski);
+    free(scratch->planes);
+    scratch->planes = NULL;
+}
+
+// The key length stages every cracker runs: Kasiski and the autocorrelation,
+// then the IC of every stride up to the longest key the text can show (a
+// column needs two letters for its IC) split between `threads` workers.
+// Returns 0 if no length passes, otherwise the curve holds the key columns
+static size_t crack_key_len(CrackScratch* scratch, const char* text, size_t len, size_t threads) {
+    IcCurve* curve = &scratch->curve;
+    size_t max_stride = len / 2 < curve->max_stride ? len / 2 : curve->max_stride;
+    memset(curve->ic, 0, sizeof(curve->ic));
+    size_t key_len = guess_key_len(curve, &scratch->kasiski, scratch->planes, text, len);
+    if (key_len != 0 && key_len <= max_stride) return key_len;
+    // the guesses may have left ICs of strides past max_stride
+    memset(curve->ic, 0, sizeof(curve->ic));
+    if (max_stride == 0) return 0;
+    ic_curve_build_parallel(curve, text, len, max_stride, threads);
+    return ic_curve_key_len(curve, IC_THRESHOLD);
+}
+
+// same result as break_vigenere, key lengths and key columns are spread over `threads` workers
+const char* break_vigenere_parallel(const char* text, size_t len, size_t threads) {
+    CrackScratch scratch;
+    if (!crack_scratch_init(&scratch)) return NULL;
+    VigenereJob job = { &scratch.curve, text, len, 0, 0, NULL };
+    job.key_len = crack_key_len(&scratch, text, len, threads);
+    if (job.key_len != 0) job.key = (char*)malloc(job.key_len+1);
+    if (job.key != NULL) {
+        run_workers(threads < job.key_len ? threads : job.key_len, key_columns_worker, &job);
+        job.key[job.key_len] = 0;
+    }
+    crack_scratch_free(&scratch);
+    return job.key;
+}
+
+const char* break_vigenere(const char* text, size_t len) {
+    return break_vigenere_parallel(text, len, 1);
+}
+
+// Streaming analyzer
+//
+// Cracks a stream of raw bytes chunk by chunk without keeping it: only the
+// per-column letter counts of a fixed set of candidate key lengths are kept,
+// so memory depends on the candidates and not on the input. Chunks are counted
+// into 32-bit histograms which are flushed into 64-bit totals long before they
+// could overflow.
+
+#define STREAM_FLUSH_LETTERS ((uint64_t)1<<31)
+
+typedef struct {
+    size_t count;
+    size_t lens[KEY_BUF_LEN];
+    size_t offsets[KEY_BUF_LEN]; // first counter of every candidate
+    uint32_t* pending;
+    uint64_t* total;
+    uint64_t pending_letters;
+    uint64_t letters;
+    char buf[READ_CHUNK_LEN];
+} VigenereStream;
+
+bool vigenere_stream_init(VigenereStream* stream, const size_t* lens, size_t count) {
+    assert(count < KEY_BUF_LEN);
+    size_t counters = 0;
+    for (size_t i = 0; i < count; i++) {
+        assert(1 <= lens[i] && lens[i] < KEY_BUF_LEN);
+        stream->lens[i] = lens[i];
+        stream->offsets[i] = counters;
+        counters += 26 * lens[i];
+    }
+    stream->count = count;
+    stream->pending = (uint32_t*)calloc(counters, sizeof(uint32_t));
+    stream->total = (uint64_t*)calloc(counters, sizeof(uint64_t));
+    stream->pending_letters = 0;
+    stream->letters = 0;
+    return stream->pending != NULL && stream->total != NULL;
+}
+
+void vigenere_stream_free(VigenereStream* stream) {
+    free(stream->pending);
+    free(stream->total);
+    stream->pending = NULL;
+    stream->total = NULL;
+}
+
+static void vigenere_stream_flush(VigenereStream* stream) {
+    size_t counters = stream->count == 0 ? 0 : stream->offsets[stream->count-1] + 26 * stream->lens[stream->count-1];
+    for (size_t i = 0; i < counters; i++) {
+        stream->total[i] += stream->pending[i];
+    }
+    memset(stream->pending, 0, sizeof(uint32_t) * counters);
+    stream->pending_letters = 0;
+}
+
+// counts the letters of the next chunk of raw bytes
+void vigenere_stream_feed(VigenereStream* stream, const char* bytes, size_t len) {
+    for (size_t done = 0; done < len; done += READ_CHUNK_LEN) {
+        size_t n = len - done < READ_CHUNK_LEN ? len - done : READ_CHUNK_LEN;
+        size_t letters = compact_letters(stream->buf, bytes + done, n);
+        if (stream->pending_letters + letters > STREAM_FLUSH_LETTERS) {
+            vigenere_stream_flush(stream);
+        }
+        for (size_t i = 0; i < stream->count; i++) {
+            size_t column = (size_t)(stream->letters % stream->lens[i]);
+            accumulate_columns(&stream->pending[stream->offsets[i]], stream->lens[i], column, stream->buf, letters);
+        }
+        stream->pending_letters += letters;
+        stream->letters += letters;
+    }
+}
+
+static void vigenere_stream_column(const VigenereStream* stream, size_t candidate, size_t column, double* counts) {
+    size_t at = stream->offsets[candidate] + 26 * column;
+    for (size_t i = 0; i < 26; i++) {
+        counts[i] = (double)stream->total[at + i] + (double)stream->pending[at + i];
+    }
+}
+
+// best key for the letters seen so far: the first candidate above IC_THRESHOLD,
+// or the one with the highest IC. Returns its length (0 before any letters)
+size_t vigenere_stream_key(const VigenereStream* stream, char* key, double* ic_out) {
+    size_t best = stream->count;
+    double best_ic = 0.;
+    double counts[26];
+    for (size_t i = 0; i < stream->count; i++) {
+        double ic = 0.;
+        for (size_t j = 0; j < stream->lens[i]; j++) {
+            vigenere_stream_column(stream, i, j, counts);
+            double count = 0.;
+            double pairs = 0.;
+            for (size_t c = 0; c < 26; c++) {
+                count += counts[c];
+                pairs += counts[c] * (counts[c] - 1.);
+            }
+            if (count >= 2.) ic += 26. * pairs / (count * (count - 1.));
+        }
+        ic /= (double)stream->lens[i];
+        if (ic > best_ic) {
+            best = i;
+            best_ic = ic;
+        }
         if (ic > IC_THRESHOLD) break;
-    } 
-    if (key_len == KEY_BUF_LEN) return NULL;
-    char* key = malloc(key_len+1);
+    }
+    if (ic_out != NULL) *ic_out = best_ic;
+    if (best == stream->count) {
+        key[0] = 0;
+        return 0;
+    }
+    size_t key_len = stream->lens[best];
+    for (size_t j = 0; j < key_len; j++) {
+        vigenere_stream_column(stream, best, j, counts);
+        key[j] = 'a' + (char)caesar_shift_from_counts(counts, NULL);
+    }
+    key[key_len] = 0;
+    return key_len;
+}
+
+// Repeating-key byte ciphers
+//
+// The same attack over the full 256-symbol alphabet, for binary data under a
+// repeating XOR or byte-add key. The key length comes from the coincidence
+// rate of the text with itself shifted by every candidate length (AVX2
+// compares, on a prefix of the data); each key byte is then scored against a
+// pluggable ByteModel on the histogram of its column.
+
+typedef enum {
+    BYTE_CIPHER_XOR,
+    BYTE_CIPHER_ADD,
+} ByteCipher;
+
+// log-probabilities of plaintext bytes
+typedef struct {
+    double logp[256];
+} ByteModel;
+
+static void byte_model_normalize(ByteModel* model, const double* weight) {
+    double total = 0.;
+    for (size_t i = 0; i < 256; i++) {
+        total += weight[i];
+    }
+    for (size_t i = 0; i < 256; i++) {
+        model->logp[i] = log(weight[i] / total);
+    }
+}
+
+// ASCII text built on the current letter frequencies
+void byte_model_english(ByteModel* model) {
+    double weight[256];
+    for (size_t i = 0; i < 256; i++) {
+        weight[i] = 1e-7;
+    }
+    for (size_t i = 0; i < 26; i++) {
+        weight['a' + i] = 0.72 * letter_freq[i];
+        weight['A' + i] = 0.04 * letter_freq[i];
+    }
+    weight[' '] = 0.17;
+    weight['\n'] = 0.02;
+    for (const char* c = ".,;:'\"-()"; *c != 0; c++) {
+        weight[(uint8_t)*c] = 0.003;
+    }
+    for (size_t i = 0; i < 10; i++) {
+        weight['0' + i] = 0.002;
+    }
+    byte_model_normalize(model, weight);
+}
+
+// byte frequencies of a plaintext sample, add-one smoothed
+void byte_model_from_sample(ByteModel* model, const uint8_t* data, size_t len) {
+    uint64_t freq[256] = {0};
+    for (size_t i = 0; i < len; i++) {
+        freq[data[i]] += 1;
+    }
+    double weight[256];
+    for (size_t i = 0; i < 256; i++) {
+        weight[i] = (double)freq[i] + 1.;
+    }
+    byte_model_normalize(model, weight);
+}
+
+static uint8_t byte_decrypt(ByteCipher cipher, uint8_t c, uint8_t k) {
+    return cipher == BYTE_CIPHER_XOR ? c ^ k : (uint8_t)(c - k);
+}
+
+void byte_encrypt(ByteCipher cipher, const uint8_t* key, size_t key_len, uint8_t* data, size_t len) {
+    for (size_t i = 0, j = 0; i < len; i++) {
+        data[i] = cipher == BYTE_CIPHER_XOR ? data[i] ^ key[j] : (uint8_t)(data[i] + key[j]);
+        if (++j == key_len) j = 0;
+    }
+}
+
+void byte_decrypt_buf(ByteCipher cipher, const uint8_t* key, size_t key_len, uint8_t* data, size_t len) {
+    for (size_t i = 0, j = 0; i < len; i++) {
+        data[i] = byte_decrypt(cipher, data[i], key[j]);
+        if (++j == key_len) j = 0;
+    }
+}
+
+// Per-column byte histograms for one stride, counted scalar. At stride 1
+// row r counts into table r % 4, so a run of equal bytes doesn't chain its
+// increments through one counter (store-to-load forwarding stalls). From
+// stride 2 on the other columns' increments already separate those of a
+// column and one table is faster, being smaller. The tables are summed into
+// 64-bit totals at the end.
+
+#define BYTE_HIST_TABLES 4
+// strides below this count into BYTE_HIST_TABLES tables
+#define BYTE_HIST_MULTI_STRIDE 2
+_Static_assert((BYTE_HIST_TABLES & (BYTE_HIST_TABLES - 1)) == 0, "tables are picked by a mask");
+
+typedef struct {
+    size_t stride;
+    size_t tables_used;
+    uint32_t* tables; // BYTE_HIST_TABLES * stride * 256
+    uint64_t* freq; // stride * 256
+} ByteHistogram;
+
+// false if out of memory
+bool byte_histogram_init(ByteHistogram* hist) {
+    hist->stride = 0;
+    hist->tables_used = 0;
+    hist->tables = (uint32_t*)malloc(sizeof(uint32_t) * BYTE_HIST_TABLES * (KEY_BUF_LEN - 1) * 256);
+    hist->freq = (uint64_t*)malloc(sizeof(uint64_t) * (KEY_BUF_LEN - 1) * 256);
+    if (hist->tables == NULL || hist->freq == NULL) {
+        free(hist->tables);
+        free(hist->freq);
+        return false;
+    }
+    return true;
+}
+
+void byte_histogram_free(ByteHistogram* hist) {
+    free(hist->tables);
+    free(hist->freq);
+}
+
+// tables are flushed before a 32-bit counter could overflow
+#define BYTE_HIST_FLUSH_ROWS ((size_t)1<<30)
+
+static void byte_histogram_flush(ByteHistogram* hist) {
+    size_t counters = hist->stride * 256;
+    for (size_t t = 0; t < hist->tables_used; t++) {
+        const uint32_t* table = &hist->tables[t * counters];
+        for (size_t i = 0; i < counters; i++) {
+            hist->freq[i] += table[i];
+        }
+    }
+    memset(hist->tables, 0, sizeof(uint32_t) * hist->tables_used * counters);
+}
+
+void byte_histogram_build(ByteHistogram* hist, const uint8_t* data, size_t len, size_t stride) {
+    assert(1 <= stride && stride < KEY_BUF_LEN);
+    hist->stride = stride;
+    hist->tables_used = stride < BYTE_HIST_MULTI_STRIDE ? BYTE_HIST_TABLES : 1;
+    size_t counters = stride * 256;
+    memset(hist->tables, 0, sizeof(uint32_t) * hist->tables_used * counters);
+    memset(hist->freq, 0, sizeof(uint64_t) * counters);
+    size_t rows = len / stride;
+    size_t i = 0;
+    for (size_t row = 0; row < rows; row++, i += stride) {
+        // tables_used is a power of two
+        uint32_t* f = &hist->tables[(row & (hist->tables_used - 1)) * counters];
+        for (size_t j = 0; j < stride; j++, f += 256) {
+            f[data[i + j]] += 1;
+        }
+        if ((row + 1) % BYTE_HIST_FLUSH_ROWS == 0) byte_histogram_flush(hist);
+    }
+    for (size_t j = 0; i < len; i++, j++) {
+        hist->tables[j * 256 + data[i]] += 1;
+    }
+    byte_histogram_flush(hist);
+}
+
+// IC of the whole alphabet, 256 for uniform random data
+double byte_histogram_ic(const ByteHistogram* hist) {
+    double ic = 0.;
+    for (size_t j = 0; j < hist->stride; j++) {
+        const uint64_t* f = &hist->freq[j * 256];
+        double count = 0.;
+        double pairs = 0.;
+        for (size_t b = 0; b < 256; b++) {
+            count += (double)f[b];
+            pairs += (double)f[b] * ((double)f[b] - 1.);
+        }
+        if (count >= 2.) ic += 256. * pairs / (count * (count - 1.));
+    }
+    return ic / (double)hist->stride;
+}
+
+// 0 if out of memory
+double compute_ic_bytes(const uint8_t* data, size_t len, size_t stride) {
+    ByteHistogram hist;
+    if (!byte_histogram_init(&hist)) return 0.;
+    byte_histogram_build(&hist, data, len, stride);
+    double ic = byte_histogram_ic(&hist);
+    byte_histogram_free(&hist);
+    return ic;
+}
+
+// key byte of one column maximizing the model log-likelihood of its plaintext
+uint8_t break_byte_column(const uint64_t* freq, ByteCipher cipher, const ByteModel* model, double* score_out) {
+    double best = -INFINITY;
+    uint8_t best_key = 0;
+    for (size_t k = 0; k < 256; k++) {
+        double score = 0.;
+        for (size_t b = 0; b < 256; b++) {
+            if (freq[b] == 0) continue;
+            score += (double)freq[b] * model->logp[byte_decrypt(cipher, (uint8_t)b, (uint8_t)k)];
+        }
+        if (score > best) {
+            best = score;
+            best_key = (uint8_t)k;
+        }
+    }
+    if (score_out != NULL) *score_out = best;
+    return best_key;
+}
+
+#define BYTE_COINCIDENCE_BLOCK (1<<12)
+
+// counts[d] = #{i : data[i] == data[i+d]} for d in 1..max_shift, the data is
+// walked in blocks so every shift reuses it from L1
+void byte_coincidences(const uint8_t* data, size_t len, size_t max_shift, uint64_t* counts) {
+    memset(counts, 0, sizeof(uint64_t) * (max_shift + 1));
+    for (size_t block = 0; block < len; block += BYTE_COINCIDENCE_BLOCK) {
+        size_t block_end = len - block < BYTE_COINCIDENCE_BLOCK ? len : block + BYTE_COINCIDENCE_BLOCK;
+        for (size_t d = 1; d <= max_shift && d < len; d++) {
+            // pairs (i, i+d) with i in the block and i+d in the data
+            size_t end = block_end < len - d ? block_end : len - d;
+            size_t i = block;
+            uint64_t count = 0;
+#if defined(__AVX2__)
+            for (; i + 32 <= end; i += 32) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+                __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + d));
+                count += (uint64_t)__builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+            }
+#endif
+            for (; i < end; i++) {
+                count += data[i] == data[i + d];
+            }
+            counts[d] += count;
+        }
+    }
+}
+
+// enough for the key length, the columns are solved on the whole data
+#define BYTE_DETECT_SAMPLE (1<<22)
+// key length multiples keep the plaintext coincidence rate, other shifts drop
+#define BYTE_KEY_LEN_RATIO 0.75
+
+size_t byte_key_len(const uint8_t* data, size_t len) {
+    size_t n = len < BYTE_DETECT_SAMPLE ? len : BYTE_DETECT_SAMPLE;
+    size_t max_shift = KEY_BUF_LEN - 1 < n / 2 ? KEY_BUF_LEN - 1 : n / 2;
+    if (max_shift == 0) return 0;
+    uint64_t counts[KEY_BUF_LEN];
+    byte_coincidences(data, n, max_shift, counts);
+    double rate[KEY_BUF_LEN];
+    double best = 0.;
+    for (size_t d = 1; d <= max_shift; d++) {
+        rate[d] = (double)counts[d] / (double)(n - d);
+        if (rate[d] > best) best = rate[d];
+    }
+    for (size_t d = 1; d <= max_shift; d++) {
+        if (rate[d] >= BYTE_KEY_LEN_RATIO * best) return d;
+    }
+    return 0;
+}
+
+// recovers a repeating key of up to KEY_BUF_LEN-1 bytes, returns its length
+// (0 if the data is too short or out of memory), *ic_out gets the byte IC at
+// that length
+size_t break_repeating_key(const uint8_t* data, size_t len, ByteCipher cipher, const ByteModel* model, uint8_t* key, double* ic_out) {
+    size_t key_len = byte_key_len(data, len);
+    if (key_len == 0) return 0;
+    ByteHistogram hist;
+    if (!byte_histogram_init(&hist)) return 0;
+    byte_histogram_build(&hist, data, len, key_len);
+    for (size_t j = 0; j < key_len; j++) {
+        key[j] = break_byte_column(&hist.freq[j * 256], cipher, model, NULL);
+    }
+    if (ic_out != NULL) *ic_out = byte_histogram_ic(&hist);
+    byte_histogram_free(&hist);
+    return key_len;
+}
+
+// Quadgram hill climbing
+//
+// For short texts and for autokey, where column statistics don't work. Keys
+// are scored by the log-probability of all quadgrams of their plaintext and
+// improved one key letter at a time, with random restarts spread over the
+// workers. Changing key[j] only changes plaintext column j (for autokey the
+// change ripples down the same column), so only the quadgrams touching that
+// column are rescored.
+// http://practicalcryptography.com/cryptanalysis/text-characterisation/quadgrams/
+
+#define QUADGRAM_COUNT (26*26*26*26)
+// log-probabilities are stored as int16 in 1/QUADGRAM_SCALE nats, 914 KB
+#define QUADGRAM_SCALE 64.
+#define QUADGRAM_FLOOR 0.01
+
+typedef struct {
+    const int16_t* logp;
+} QuadgramModel;
+
+static size_t quadgram_index(const uint8_t* p) {
+    return ((size_t)p[0] * 26 + p[1]) * 26 * 26 + (size_t)p[2] * 26 + p[3];
+}
+
+// unseen quadgrams get QUADGRAM_FLOOR of a count
+static void quadgram_logp_from_counts(int16_t* logp, const uint64_t* counts) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < QUADGRAM_COUNT; i++) {
+        total += counts[i];
+    }
+    double log_total = log((double)total + 1.);
+    for (size_t i = 0; i < QUADGRAM_COUNT; i++) {
+        double count = counts[i] != 0 ? (double)counts[i] : QUADGRAM_FLOOR;
+        logp[i] = (int16_t)lrint((log(count) - log_total) * QUADGRAM_SCALE);
+    }
+}
+
+// log-probabilities of quadgrams of a letters-only corpus
+bool quadgram_model_build(QuadgramModel* model, const char* text, size_t len) {
+    uint64_t* counts = (uint64_t*)calloc(QUADGRAM_COUNT, sizeof(uint64_t));
+    int16_t* logp = (int16_t*)malloc(sizeof(int16_t) * QUADGRAM_COUNT);
+    if (counts == NULL || logp == NULL) {
+        free(counts);
+        free(logp);
+        model->logp = NULL;
+        return false;
+    }
+    for (size_t i = 0; i + 4 <= len; i++) {
+        uint8_t q[4] = { text[i] - 'a', text[i+1] - 'a', text[i+2] - 'a', text[i+3] - 'a' };
+        counts[quadgram_index(q)] += 1;
+    }
+    quadgram_logp_from_counts(logp, counts);
+    model->logp = logp;
+    free(counts);
+    return true;
+}
+
+// only for models from quadgram_model_build
+void quadgram_model_free(QuadgramModel* model) {
+    free((void*)model->logp);
+    model->logp = NULL;
+}
+
+void autokey_encrypt(const char* primer, char* message, size_t len) {
+    size_t key_len = strlen(primer);
+    // backwards, so message[i - key_len] is still plaintext
+    for (size_t i = len; i-- > 0;) {
+        int k = i < key_len ? primer[i] - 'a' : message[i - key_len] - 'a';
+        message[i] = 'a' + (message[i] - 'a' + k) % 26;
+    }
+}
+
+void autokey_decrypt(const char* primer, char* message, size_t len) {
+    size_t key_len = strlen(primer);
+    for (size_t i = 0; i < len; i++) {
+        int k = i < key_len ? primer[i] - 'a' : message[i - key_len] - 'a';
+        message[i] = 'a' + (message[i] - 'a' + 26 - k) % 26;
+    }
+}
+
+typedef struct {
+    const QuadgramModel* model;
+    const uint8_t* cipher; // letters as 0..25
+    size_t len;
+    size_t key_len;
+    bool autokey;
+    size_t restarts;
+    uint32_t seed;
+    // per worker results
+    int64_t scores[MAX_WORKERS];
+    uint8_t keys[MAX_WORKERS][KEY_BUF_LEN];
+} QuadgramJob;
+
+// score of a solve that couldn't run, below any real score
+#define QUADGRAM_FAILED INT64_MIN
+
+// plaintext of key column j into plain
+static void quadgram_decrypt_column(const QuadgramJob* job, uint8_t* plain, size_t j, uint8_t k) {
+    uint8_t prev = k;
+    for (size_t i = j; i < job->len; i += job->key_len) {
+        uint8_t p = (uint8_t)((job->cipher[i] + 26 - prev) % 26);
+        plain[i] = p;
+        if (job->autokey) prev = p;
+    }
+}
+
+static int64_t quadgram_score_range(const QuadgramModel* model, const uint8_t* plain, size_t begin, size_t end) {
+    int64_t score = 0;
+    for (size_t i = begin; i < end; i++) {
+        score += model->logp[quadgram_index(&plain[i])];
+    }
+    return score;
+}
+
+// score of the quadgrams touching column j
+static int64_t quadgram_score_column(const QuadgramJob* job, const uint8_t* plain, size_t j) {
+    int64_t score = 0;
+    size_t starts = job->len - 3;
+    size_t done = 0; // quadgrams before this one are already counted
+    for (size_t i = j; i < job->len; i += job->key_len) {
+        size_t begin = i >= 3 ? i - 3 : 0;
+        if (begin < done) begin = done;
+        size_t end = i + 1 < starts ? i + 1 : starts;
+        if (begin < end) {
+            score += quadgram_score_range(job->model, plain, begin, end);
+            done = end;
+        }
+    }
+    return score;
+}
+
+static void quadgram_worker(void* ctx, size_t worker, size_t workers) {
+    QuadgramJob* job = (QuadgramJob*)ctx;
+    job->scores[worker] = QUADGRAM_FAILED;
+    uint8_t* plain = (uint8_t*)malloc(job->len);
+    if (plain == NULL) return;
+    uint8_t key[KEY_BUF_LEN];
+    uint32_t rng_state = job->seed ^ (uint32_t)(worker * 0x9E3779B9u);
+    if (rng_state == 0) rng_state = 1;
+    size_t begin, end;
+    split_range(job->restarts, worker, workers, &begin, &end);
+    for (size_t restart = begin; restart < end; restart++) {
+        for (size_t j = 0; j < job->key_len; j++) {
+            key[j] = (uint8_t)(xorshift_next(&rng_state) % 26);
+            quadgram_decrypt_column(job, plain, j, key[j]);
+        }
+        int64_t score = quadgram_score_range(job->model, plain, 0, job->len - 3);
+        // steepest ascent on one key letter at a time until a sweep changes nothing
+        bool improved = true;
+        while (improved) {
+            improved = false;
+            for (size_t j = 0; j < job->key_len; j++) {
+                int64_t old_column = quadgram_score_column(job, plain, j);
+                int64_t best_delta = 0;
+                uint8_t best_k = key[j];
+                for (uint8_t k = 0; k < 26; k++) {
+                    if (k == key[j]) continue;
+                    quadgram_decrypt_column(job, plain, j, k);
+                    int64_t delta = quadgram_score_column(job, plain, j) - old_column;
+                    if (delta > best_delta) {
+                        best_delta = delta;
+                        best_k = k;
+                    }
+                }
+                quadgram_decrypt_column(job, plain, j, best_k);
+                if (best_k != key[j]) {
+                    key[j] = best_k;
+                    score += best_delta;
+                    improved = true;
+                }
+            }
+        }
+        if (score > job->scores[worker]) {
+            job->scores[worker] = score;
+            memcpy(job->keys[worker], key, job->key_len);
+        }
+    }
+    free(plain);
+}
+
+// best key of the given length by quadgram score over `restarts` random
+// starts on `threads` workers, returns the score (in 1/QUADGRAM_SCALE nats),
+// QUADGRAM_FAILED with an empty key if out of memory
+int64_t solve_quadgram(const QuadgramModel* model, const char* text, size_t len, size_t key_len, bool autokey,
+                       size_t restarts, size_t threads, char* key) {
+    assert(len >= 4 && 1 <= key_len && key_len < KEY_BUF_LEN && restarts >= 1);
+    key[0] = 0;
+    QuadgramJob* job = (QuadgramJob*)malloc(sizeof(QuadgramJob));
+    uint8_t* cipher = (uint8_t*)malloc(len);
+    if (job == NULL || cipher == NULL) {
+        free(job);
+        free(cipher);
+        return QUADGRAM_FAILED;
+    }
+    for (size_t i = 0; i < len; i++) {
+        cipher[i] = (uint8_t)(text[i] - 'a');
+    }
+    job->model = model;
+    job->cipher = cipher;
+    job->len = len;
+    job->key_len = key_len;
+    job->autokey = autokey;
+    job->restarts = restarts;
+    job->seed = 42 + (uint32_t)key_len;
+    size_t workers = threads < restarts ? threads : restarts;
+    run_workers(workers, quadgram_worker, job);
+    // lowest worker wins ties, so the result only depends on the thread count
+    size_t best = 0;
+    for (size_t w = 1; w < workers; w++) {
+        if (job->scores[w] > job->scores[best]) best = w;
+    }
+    // a worker out of memory loses to any other, if all were the key stays empty
+    int64_t score = job->scores[best];
+    if (score != QUADGRAM_FAILED) {
+        for (size_t j = 0; j < key_len; j++) {
+            key[j] = 'a' + (char)job->keys[best][j];
+        }
+        key[key_len] = 0;
+    }
+    free(cipher);
+    free(job);
+    return score;
+}
+
+// a longer key always fits a bit better, so the shortest length within this
+// many nats per letter of the best one wins
+#define QUADGRAM_LEN_SLACK 0.05
+
+// tries every key length up to max_key_len, returns the chosen one, 0 with
+// an empty key if out of memory
+size_t break_quadgram(const QuadgramModel* model, const char* text, size_t len, size_t max_key_len, bool autokey,
+                      size_t restarts, size_t threads, char* key) {
+    int64_t scores[KEY_BUF_LEN];
+    char keys[KEY_BUF_LEN][KEY_BUF_LEN];
+    int64_t best = INT64_MIN;
+    key[0] = 0;
+    for (size_t l = 1; l <= max_key_len; l++) {
+        scores[l] = solve_quadgram(model, text, len, l, autokey, restarts, threads, keys[l]);
+        if (scores[l] == QUADGRAM_FAILED) return 0;
+        if (scores[l] > best) best = scores[l];
+    }
+    int64_t slack = (int64_t)(QUADGRAM_LEN_SLACK * QUADGRAM_SCALE * (double)len);
+    for (size_t l = 1; l <= max_key_len; l++) {
+        if (scores[l] >= best - slack) {
+            memcpy(key, keys[l], l + 1);
+            return l;
+        }
+    }
+    return 0;
+}
+
+// Language models
+//
+// Unigram, bigram and quadgram statistics of a corpus in a versioned binary
+// file. The file is a LanguageModelFile as is (native byte order), so loading
+// it is one mmap and a header check with nothing to parse. Building splits
+// the corpus between workers by range, an n-gram belongs to the range it
+// starts in. The alphabet is a-z, corpora in other scripts have to be
+// transliterated first (the header records the alphabet size for that).
+// Unigram and bigram counts are add-one smoothed, a letter missing from the
+// corpus would otherwise be an expected count of 0 for the chi-squared test.
+
+#define LANGUAGE_MODEL_MAGIC "L1LM"
+// 2: smoothed frequencies
+#define LANGUAGE_MODEL_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t alphabet;
+    uint32_t reserved;
+    uint64_t letters;
+    double unigram[26]; // frequencies, never 0
+    double bigram[26 * 26]; // frequencies, never 0, first letter major
+    int16_t quadgram[QUADGRAM_COUNT]; // as in QuadgramModel
+} LanguageModelFile;
+
+typedef struct {
+    const LanguageModelFile* file;
+    size_t map_len;
+    QuadgramModel quadgram;
+} LanguageModel;
+
+typedef struct {
+    const char* text;
+    size_t len;
+    uint64_t unigram[MAX_WORKERS][26];
+    uint64_t bigram[MAX_WORKERS][26 * 26];
+    uint32_t* quadgram[MAX_WORKERS];
+} ModelJob;
+
+#define MODEL_UNIGRAM_TABLES 4
+
+static void model_worker(void* ctx, size_t worker, size_t workers) {
+    ModelJob* job = (ModelJob*)ctx;
+    const char* t = job->text;
+    size_t len = job->len;
+    size_t begin, end;
+    split_range(len, worker, workers, &begin, &end);
+
+    // neighbouring letters count into different tables, so runs of one
+    // letter don't chain their increments through one counter
+    uint64_t unigram[MODEL_UNIGRAM_TABLES][26] = {0};
+    size_t i = begin;
+    for (; i + MODEL_UNIGRAM_TABLES <= end; i += MODEL_UNIGRAM_TABLES) {
+        for (size_t k = 0; k < MODEL_UNIGRAM_TABLES; k++) {
+            unigram[k][t[i + k] - 'a'] += 1;
+        }
+    }
+    for (; i < end; i++) {
+        unigram[0][t[i] - 'a'] += 1;
+    }
+    for (size_t c = 0; c < 26; c++) {
+        job->unigram[worker][c] = 0;
+        for (size_t k = 0; k < MODEL_UNIGRAM_TABLES; k++) {
+            job->unigram[worker][c] += unigram[k][c];
+        }
+    }
+
+    uint64_t* bigram = job->bigram[worker];
+    memset(bigram, 0, sizeof(uint64_t) * 26 * 26);
+    for (i = begin; i < end && i + 2 <= len; i++) {
+        bigram[(t[i] - 'a') * 26 + (t[i + 1] - 'a')] += 1;
+    }
+
+    uint32_t* quadgram = job->quadgram[worker];
+    memset(quadgram, 0, sizeof(uint32_t) * QUADGRAM_COUNT);
+    if (begin < end && begin + 4 <= len) {
+        size_t q = 0;
+        for (i = begin; i < begin + 3; i++) {
+            q = q * 26 + (size_t)(t[i] - 'a');
+        }
+        for (i = begin; i < end && i + 4 <= len; i++) {
+            q = (q * 26 + (size_t)(t[i + 3] - 'a')) % QUADGRAM_COUNT;
+            quadgram[q] += 1;
+        }
+    }
+}
+
+// model of a letters-only corpus, NULL if out of memory
+LanguageModelFile* language_model_build(const char* text, size_t len, size_t threads) {
+    LanguageModelFile* file = (LanguageModelFile*)calloc(1, sizeof(LanguageModelFile));
+    ModelJob* job = (ModelJob*)malloc(sizeof(ModelJob));
+    uint64_t* quadgram = (uint64_t*)calloc(QUADGRAM_COUNT, sizeof(uint64_t));
+    bool ok = file != NULL && job != NULL && quadgram != NULL;
+    for (size_t w = 0; ok && w < threads; w++) {
+        job->quadgram[w] = (uint32_t*)malloc(sizeof(uint32_t) * QUADGRAM_COUNT);
+        if (job->quadgram[w] == NULL) {
+            threads = w;
+            ok = false;
+        }
+    }
+    if (ok) {
+        job->text = text;
+        job->len = len;
+        run_workers(threads, model_worker, job);
+
+        memcpy(file->magic, LANGUAGE_MODEL_MAGIC, 4);
+        file->version = LANGUAGE_MODEL_VERSION;
+        file->alphabet = 26;
+        file->letters = len;
+        uint64_t bigrams = len >= 2 ? len - 1 : 0;
+        for (size_t w = 0; w < threads; w++) {
+            for (size_t c = 0; c < 26; c++) {
+                file->unigram[c] += (double)job->unigram[w][c];
+            }
+            for (size_t c = 0; c < 26 * 26; c++) {
+                file->bigram[c] += (double)job->bigram[w][c];
+            }
+            for (size_t c = 0; c < QUADGRAM_COUNT; c++) {
+                quadgram[c] += job->quadgram[w][c];
+            }
+        }
+        for (size_t c = 0; c < 26; c++) {
+            file->unigram[c] = len != 0 ? (file->unigram[c] + 1.) / (double)(len + 26) : expected_freq[c];
+        }
+        for (size_t c = 0; c < 26 * 26; c++) {
+            file->bigram[c] = (file->bigram[c] + 1.) / (double)(bigrams + 26 * 26);
+        }
+        quadgram_logp_from_counts(file->quadgram, quadgram);
+    }
+    for (size_t w = 0; job != NULL && w < threads; w++) {
+        free(job->quadgram[w]);
+    }
+    free(quadgram);
+    free(job);
+    if (!ok) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+bool language_model_write(const LanguageModelFile* file, const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) return false;
+    bool ok = fwrite(file, sizeof(LanguageModelFile), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    return ok;
+}
+
+bool language_model_load(LanguageModel* model, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(LanguageModelFile)) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    void* map = mmap(NULL, sizeof(LanguageModelFile), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    const LanguageModelFile* file = (const LanguageModelFile*)map;
+    if (memcmp(file->magic, LANGUAGE_MODEL_MAGIC, 4) != 0 || file->version != LANGUAGE_MODEL_VERSION || file->alphabet != 26) {
+        munmap(map, sizeof(LanguageModelFile));
+        errno = EINVAL;
+        return false;
+    }
+    model->file = file;
+    model->map_len = sizeof(LanguageModelFile);
+    model->quadgram.logp = file->quadgram;
+    return true;
+}
+
+void language_model_unload(LanguageModel* model) {
+    munmap((void*)model->file, model->map_len);
+    memset(model, 0, sizeof(LanguageModel));
+}
+
+// makes the crackers score against the model, call before starting workers
+void use_language_model(const LanguageModel* model) {
+    letter_freq = model->file->unigram;
+}
+
+static double time_now() {
+    struct timespec t = {0};
+    int ret = clock_gettime(CLOCK_MONOTONIC, &t);
+    assert(ret == 0);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void random_key(char* key, size_t key_len, uint32_t* rng_state) {
     for (size_t i = 0; i < key_len; i++) {
-        key[i] = break_caesar(text, i, key_len);   
+        key[i] = 'a' + (char)(xorshift_next(rng_state) % 26);
     }
     key[key_len] = 0;
-    return key;
+}
+
+#define BENCH_KEY_LENS_COUNT 4
+static const size_t BENCH_KEY_LENS[BENCH_KEY_LENS_COUNT] = { 64, 128, 200, 255 };
+#define BENCH_THREADS_COUNT 5
+static const size_t BENCH_THREADS[BENCH_THREADS_COUNT] = { 1, 2, 4, 8, 16 };
+
+// scaling of the parallel key length scan (the IC of every stride, what
+// break_vigenere_parallel runs when Kasiski and the autocorrelation can't
+// confirm a guess) on the sample text for long random keys. The full crack
+// mostly runs serial stages, so it is timed once after the scan. False when
+// out of memory
+static bool bench_parallel(char* data, size_t len) {
+    uint32_t rng_state = 42;
+    char key[KEY_BUF_LEN];
+    IcCurve curve;
+    if (!ic_curve_init(&curve, KEY_BUF_LEN - 1)) return false;
+    printf("len(data) = %zu\n", len);
+    printf("IC scan of %zu strides\nkey_len", curve.max_stride);
+    for (size_t t = 0; t < BENCH_THREADS_COUNT; t++) {
+        printf("\t%zu thr", BENCH_THREADS[t]);
+    }
+    putchar('\n');
+    for (size_t k = 0; k < BENCH_KEY_LENS_COUNT; k++) {
+        random_key(key, BENCH_KEY_LENS[k], &rng_state);
+        encrypt(key, data, len);
+        printf("%zu", BENCH_KEY_LENS[k]);
+        double base = 0.;
+        for (size_t t = 0; t < BENCH_THREADS_COUNT; t++) {
+            double start = time_now();
+            ic_curve_build_parallel(&curve, data, len, curve.max_stride, BENCH_THREADS[t]);
+            double elapsed = time_now() - start;
+            if (t == 0) base = elapsed;
+            bool ok = ic_curve_key_len(&curve, IC_THRESHOLD) == BENCH_KEY_LENS[k];
+            printf("\t%.3fs x%.2f%s", elapsed, base / elapsed, ok ? "" : " (wrong length)");
+            fflush(stdout);
+        }
+        double start = time_now();
+        const char* key_guess = break_vigenere_parallel(data, len, 1);
+        double elapsed = time_now() - start;
+        bool ok = key_guess != NULL && strcmp(key, key_guess) == 0;
+        printf("\tcrack %.3fs%s\n", elapsed, ok ? "" : " (wrong key)");
+        free((void*)key_guess);
+        decrypt(key, data, len);
+    }
+    ic_curve_free(&curve);
+    return true;
 }
 
 #define PASSWORD "abcd"
 //#define PASSWORD "password"
 //#define PASSWORD "averyverylongpassword"
 
-int main(int argc, const char** argv) {
-    // TODO unhardcode filename (through args?)
-    //char* data = read_sample_data("data/rfc8446.txt");
-    char* data = read_sample_data("data/sillymessage.txt");
+// batch mode
+//
+// Cracks every ciphertext of a manifest (one path per line) or a directory on
+// a pool of workers. Each worker keeps its IcCurve and text buffer for the
+// whole batch, so nothing is allocated per file once the buffers have grown.
+// Every file produces one tab separated record:
+// path, key ("-" if not found), IC of the key length, mean chi-squared of
+// the key columns, seconds spent loading and cracking, and the error ("-"
+// if none). A file that can't be read gets a record with key "-", zeros
+// and its error, and makes the batch exit with 1, as does every file of a
+// worker that couldn't allocate its IcCurve.
+
+typedef struct {
+    double ic;
+    double chisqr;
+} CrackReport;
+
+// break_vigenere on caller owned scratch, returns the key length (0 if the
+// key was not found), key must hold KEY_BUF_LEN bytes
+size_t crack_vigenere(CrackScratch* scratch, const char* text, size_t len, char* key, CrackReport* report) {
+    IcCurve* curve = &scratch->curve;
+    size_t key_len = crack_key_len(scratch, text, len, 1);
+    report->ic = curve->ic[key_len];
+    report->chisqr = 0.;
+    for (size_t i = 0; i < key_len; i++) {
+        double chisqr;
+        key[i] = 'a' + (char)caesar_shift_from_freq(ic_curve_column(curve, key_len, i), &chisqr);
+        report->chisqr += chisqr;
+    }
+    if (key_len != 0) report->chisqr /= (double)key_len;
+    key[key_len] = 0;
+    return key_len;
+}
+
+typedef struct {
+    char** paths;
+    size_t count;
+    size_t capacity;
+} PathList;
+
+static bool path_list_push(PathList* list, const char* path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 64 : 2 * list->capacity;
+        char** paths = (char**)realloc(list->paths, sizeof(char*) * capacity);
+        if (paths == NULL) return false;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if (copy == NULL) return false;
+    list->paths[list->count++] = copy;
+    return true;
+}
+
+static void path_list_free(PathList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    memset(list, 0, sizeof(PathList));
+}
+
+// regular files of a directory, or the lines of a manifest file
+static bool read_path_list(const char* path, PathList* list) {
+    DIR* dir = opendir(path);
+    if (dir != NULL) {
+        bool ok = true;
+        char buf[PATH_MAX];
+        struct dirent* entry;
+        while (ok && (entry = readdir(dir)) != NULL) {
+            snprintf(buf, sizeof(buf), "%s/%s", path, entry->d_name);
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode)) {
+                ok = path_list_push(list, buf);
+            }
+        }
+        closedir(dir);
+        return ok;
+    }
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return false;
+    bool ok = true;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    while (ok && (n = getline(&line, &line_cap, f)) > 0) {
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = 0;
+        if (n > 0) ok = path_list_push(list, line);
+    }
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+typedef struct {
+    const PathList* list;
+    atomic_size_t next;
+    atomic_size_t failed;
+} BatchJob;
+
+static void batch_worker(void* ctx, size_t worker, size_t workers) {
+    (void)worker;
+    (void)workers;
+    BatchJob* job = (BatchJob*)ctx;
+    // without its scratch a worker still takes files, and fails them
+    CrackScratch scratch;
+    bool ready = crack_scratch_init(&scratch);
+    SampleData sample = {0};
+    char key[KEY_BUF_LEN];
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->list->count) break;
+        const char* path = job->list->paths[i];
+        double start = time_now();
+        if (!ready || !read_sample_data(path, &sample)) {
+            const char* error = ready ? strerror(errno) : "out of memory";
+            fprintf(stderr, "%s: %s\n", path, error);
+            printf("%s\t-\t0\t0\t0\t%s\n", path, error);
+            atomic_fetch_add(&job->failed, 1);
+            continue;
+        }
+        CrackReport report;
+        size_t key_len = crack_vigenere(&scratch, sample.data, sample.len, key, &report);
+        double elapsed = time_now() - start;
+        // one printf per record, stdio keeps the lines whole
+        printf("%s\t%s\t%.4f\t%.2f\t%.6f\t-\n", path, key_len != 0 ? key : "-", report.ic, report.chisqr, elapsed);
+    }
+    free_sample_data(&sample);
+    if (ready) crack_scratch_free(&scratch);
+}
+
+static int task_batch(const char* path, size_t threads) {
+    PathList list = {0};
+    if (!read_path_list(path, &list)) {
+        perror(path);
+        path_list_free(&list);
+        return 1;
+    }
+    BatchJob job = { &list, 0, 0 };
+    size_t workers = threads < list.count ? threads : list.count;
+    run_workers(workers != 0 ? workers : 1, batch_worker, &job);
+    path_list_free(&list);
+    return atomic_load(&job.failed) == 0 ? 0 : 1;
+}
+
+#define USAGE \
+    "usage: lab1 <filename|-> [threads]\n" \
+    "       lab1 bench <filename|->\n" \
+    "       lab1 batch <manifest|directory> [threads]\n" \
+    "       lab1 stream [max_key_len] < ciphertext\n" \
+    "       lab1 xor|add <filename|-> [model_sample]\n" \
+    "       lab1 quadgram <corpus|model> <filename|-> [autokey] [threads]\n" \
+    "       lab1 model <corpus> <model> [threads]\n" \
+    "       -m <model> before any of them scores against the model\n"
+
+static int task_model(const char* corpus, const char* path, size_t threads) {
+    SampleData sample = {0};
+    if (!read_sample_data(corpus, &sample)) {
+        perror(corpus);
+        return 1;
+    }
+    double start = time_now();
+    LanguageModelFile* file = language_model_build(sample.data, sample.len, threads);
+    double elapsed = time_now() - start;
+    free_sample_data(&sample);
+    if (file == NULL) {
+        perror("model");
+        return 1;
+    }
+    if (!language_model_write(file, path)) {
+        perror(path);
+        free(file);
+        return 1;
+    }
+    printf("letters = %llu, built in %.3fs\n", (unsigned long long)file->letters, elapsed);
+    for (size_t c = 0; c < 26; c++) {
+        printf("%c %.5f\n", 'a' + (char)c, file->unigram[c]);
+    }
+    free(file);
+    return 0;
+}
+
+#define QUADGRAM_DEMO_LEN 300
+#define QUADGRAM_MAX_KEY_LEN 12
+#define QUADGRAM_RESTARTS 32
+
+// encrypts the first QUADGRAM_DEMO_LEN letters of the file with PASSWORD and
+// cracks them with quadgram statistics of the corpus
+static int task_quadgram(const char* corpus, const char* filename, bool autokey, size_t threads) {
+    // corpus is either a model file or a text to build the quadgrams from
+    LanguageModel language = {0};
+    QuadgramModel built = {0};
+    const QuadgramModel* model = &language.quadgram;
+    SampleData sample = {0};
+    if (!language_model_load(&language, corpus)) {
+        if (!read_sample_data(corpus, &sample)) {
+            perror(corpus);
+            return 1;
+        }
+        if (!quadgram_model_build(&built, sample.data, sample.len)) {
+            perror("quadgram model");
+            free_sample_data(&sample);
+            return 1;
+        }
+        model = &built;
+    }
+    if (!read_sample_data(filename, &sample) || sample.len < 4) {
+        perror(filename);
+        if (built.logp != NULL) quadgram_model_free(&built);
+        if (language.file != NULL) language_model_unload(&language);
+        free_sample_data(&sample);
+        return 1;
+    }
+    char* data = sample.data;
+    size_t len = sample.len < QUADGRAM_DEMO_LEN ? sample.len : QUADGRAM_DEMO_LEN;
+    if (autokey) {
+        autokey_encrypt(PASSWORD, data, len);
+    } else {
+        encrypt(PASSWORD, data, len);
+    }
+    printf("encrypted = %.*s\n", (int)len, data);
+
+    char key[KEY_BUF_LEN];
+    double start = time_now();
+    size_t key_len = break_quadgram(model, data, len, QUADGRAM_MAX_KEY_LEN, autokey, QUADGRAM_RESTARTS, threads, key);
+    if (key_len == 0) {
+        fprintf(stderr, "out of memory\n");
+        if (built.logp != NULL) quadgram_model_free(&built);
+        if (language.file != NULL) language_model_unload(&language);
+        free_sample_data(&sample);
+        return 1;
+    }
+    printf("cracked in %.3fs\n", time_now() - start);
+    printf("len(key_guess) = %zu\nkey_guess = %s\n", key_len, key);
+    if (autokey) {
+        autokey_decrypt(key, data, len);
+    } else {
+        decrypt(key, data, len);
+    }
+    printf("decrypted = %.*s\n", (int)len, data);
+    if (built.logp != NULL) quadgram_model_free(&built);
+    if (language.file != NULL) language_model_unload(&language);
+    free_sample_data(&sample);
+    return 0;
+}
+
+#define BYTE_PASSWORD "\x13\x37 some binary key \xfe\x01"
+
+static void print_hex(const uint8_t* bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        printf("%02x", bytes[i]);
+    }
+    putchar('\n');
+}
+
+// encrypts the file with BYTE_PASSWORD and cracks it back
+static int task_bytes(ByteCipher cipher, const char* filename, const char* model_sample) {
+    ByteModel model;
+    byte_model_english(&model);
+    SampleData sample = {0};
+    if (model_sample != NULL) {
+        if (!read_raw_data(model_sample, &sample)) {
+            perror(model_sample);
+            return 1;
+        }
+        byte_model_from_sample(&model, (const uint8_t*)sample.data, sample.len);
+    }
+    if (!read_raw_data(filename, &sample)) {
+        perror(filename);
+        printf(USAGE);
+        free_sample_data(&sample);
+        return 1;
+    }
+    uint8_t* data = (uint8_t*)sample.data;
+    size_t len = sample.len;
+    const size_t password_len = sizeof(BYTE_PASSWORD) - 1;
+    printf("len(data) = %zu\n", len);
+    byte_encrypt(cipher, (const uint8_t*)BYTE_PASSWORD, password_len, data, len);
+    printf("key = ");
+    print_hex((const uint8_t*)BYTE_PASSWORD, password_len);
+
+    uint8_t key[KEY_BUF_LEN];
+    double ic;
+    double start = time_now();
+    size_t key_len = break_repeating_key(data, len, cipher, &model, key, &ic);
+    if (key_len == 0) {
+        printf("key not found\n");
+        free_sample_data(&sample);
+        return 1;
+    }
+    printf("cracked in %.3fs\n", time_now() - start);
+    printf("len(key_guess) = %zu, ic = %.2f\n", key_len, ic);
+    printf("key_guess = ");
+    print_hex(key, key_len);
+    free_sample_data(&sample);
+    return 0;
+}
+
+#define STREAM_REPORT_LETTERS ((uint64_t)1<<24)
+#define STREAM_DEFAULT_MAX_KEY_LEN 32
+
+// cracks stdin as it arrives, reporting the current key every STREAM_REPORT_LETTERS letters
+static int task_stream(size_t max_key_len) {
+    size_t lens[KEY_BUF_LEN];
+    for (size_t i = 0; i < max_key_len; i++) {
+        lens[i] = i + 1;
+    }
+    VigenereStream* stream = (VigenereStream*)malloc(sizeof(VigenereStream));
+    if (stream == NULL || !vigenere_stream_init(stream, lens, max_key_len)) {
+        perror("stream");
+        free(stream);
+        return 1;
+    }
+    char buf[READ_CHUNK_LEN];
+    char key[KEY_BUF_LEN];
+    uint64_t next_report = STREAM_REPORT_LETTERS;
+    int ret = 0;
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("stdin");
+            ret = 1;
+        }
+        if (n <= 0) break;
+        vigenere_stream_feed(stream, buf, (size_t)n);
+        if (stream->letters >= next_report) {
+            double ic;
+            vigenere_stream_key(stream, key, &ic);
+            printf("letters = %llu, ic = %.4f, key_guess = %s\n", (unsigned long long)stream->letters, ic, key);
+            fflush(stdout);
+            next_report = stream->letters + STREAM_REPORT_LETTERS;
+        }
+    }
+    double ic;
+    size_t key_len = vigenere_stream_key(stream, key, &ic);
+    printf("letters = %llu, ic = %.4f\n", (unsigned long long)stream->letters, ic);
+    printf("len(key_guess) = %zu\nkey_guess = %s\n", key_len, key);
+    vigenere_stream_free(stream);
+    free(stream);
+    return ret;
+}
+
+static int task_crack(const char* filename, size_t threads, bool bench) {
+    SampleData sample = {0};
+    if (!read_sample_data(filename, &sample)) {
+        perror(filename);
+        printf(USAGE);
+        return 1;
+    }
+    char* data = sample.data;
+    size_t len = sample.len;
+    if (bench) {
+        bool ok = bench_parallel(data, len);
+        if (!ok) fprintf(stderr, "out of memory\n");
+        free_sample_data(&sample);
+        return ok ? 0 : 1;
+    }
     
-    printf("len(data) = %zu\n", strlen(data));
-    encrypt(PASSWORD, data);
-    printf("encrypted = %s\n", data);
+    printf("len(data) = %zu\n", len);
+    encrypt(PASSWORD, data, len);
+    printf("encrypted = %.*s\n", (int)len, data);
 
-    const char* key_guess = break_vigenere(data);
+    const char* key_guess = break_vigenere_parallel(data, len, threads);
+    if (key_guess == NULL) {
+        printf("key not found\n");
+        free_sample_data(&sample);
+        return 1;
+    }
     printf("len(key_guess) = %zu\n", strlen(key_guess));
     printf("key_guess = %s\n", key_guess);
 
-    //decrypt(PASSWORD, data);
-    decrypt(key_guess, data);
-    printf("decrypted = %s\n", data);
+    //decrypt(PASSWORD, data, len);
+    decrypt(key_guess, data, len);
+    printf("decrypted = %.*s\n", (int)len, data);
 
     free((void*)key_guess);
-    free((void*)data);
+    free_sample_data(&sample);
+    return 0;
+}
+
+#ifndef LAB1_NOMAIN
+static int run_task(int argc, const char** argv) {
+    if (argc < 2) {
+        printf(USAGE);
+        return 1;
+    }
+    if (strcmp(argv[1], "model") == 0) {
+        size_t threads = argc > 4 ? (size_t)atoi(argv[4]) : 1;
+        if (argc < 4 || threads < 1 || threads > MAX_WORKERS) {
+            printf(USAGE);
+            return 1;
+        }
+        return task_model(argv[2], argv[3], threads);
+    }
+    if (strcmp(argv[1], "stream") == 0) {
+        size_t max_key_len = argc > 2 ? (size_t)atoi(argv[2]) : STREAM_DEFAULT_MAX_KEY_LEN;
+        if (max_key_len < 1 || max_key_len >= KEY_BUF_LEN) {
+            printf(USAGE);
+            return 1;
+        }
+        return task_stream(max_key_len);
+    }
+    if (strcmp(argv[1], "xor") == 0 || strcmp(argv[1], "add") == 0) {
+        if (argc < 3) {
+            printf(USAGE);
+            return 1;
+        }
+        ByteCipher cipher = argv[1][0] == 'x' ? BYTE_CIPHER_XOR : BYTE_CIPHER_ADD;
+        return task_bytes(cipher, argv[2], argc > 3 ? argv[3] : NULL);
+    }
+    if (strcmp(argv[1], "quadgram") == 0) {
+        if (argc < 4) {
+            printf(USAGE);
+            return 1;
+        }
+        int arg = 4;
+        bool autokey = arg < argc && strcmp(argv[arg], "autokey") == 0;
+        if (autokey) arg++;
+        size_t threads = arg < argc ? (size_t)atoi(argv[arg]) : 1;
+        if (threads < 1 || threads > MAX_WORKERS) {
+            printf(USAGE);
+            return 1;
+        }
+        return task_quadgram(argv[2], argv[3], autokey, threads);
+    }
+    bool bench = strcmp(argv[1], "bench") == 0;
+    bool batch = strcmp(argv[1], "batch") == 0;
+    int arg = bench || batch ? 2 : 1;
+    const char* filename = argv[arg];
+    size_t threads = !bench && arg + 1 < argc ? (size_t)atoi(argv[arg + 1]) : 1;
+    if (filename == NULL || threads < 1 || threads > MAX_WORKERS) {
+        printf(USAGE);
+        return 1;
+    }
+    if (batch) {
+        return task_batch(filename, threads);
+    }
+    return task_crack(filename, threads, bench);
+}
+
+int main(int argc, const char** argv) {
+    LanguageModel language = {0};
+    if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+        if (!language_model_load(&language, argv[2])) {
+            perror(argv[2]);
+            return 1;
+        }
+        use_language_model(&language);
+        argc -= 2;
+        argv += 2;
+    }
+    int ret = run_task(argc, argv);
+    if (language.file != NULL) {
+        letter_freq = expected_freq;
+        language_model_unload(&language);
+    }
+    return ret;
 }
+#endif//LAB1_NOMAIN
@@ -0,0 +1,292 @@
+// writes lab2_tables.h: the GF(2^8), AES and vperm tables of lab2 as static
+// const data, so the cipher doesn't build them at every start
+//
+// usage: gen_tables > lab2_tables.h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// must match MAX_AES_ROUNDS + 1 of lab2, checked there
+#define RCON_COUNT 33
+
+// in GF(2^8) with polynomial x^8 + x^4 + x^3 + x + 1
+
+static uint8_t ff_mult_dumm(uint8_t a, uint8_t b) {
+    const unsigned poly = (unsigned)0b100011011; // x^8 + x^4 + x^3 + x + 1
+    unsigned value = 0;
+    // multiply
+    for (unsigned i = 0; i < 8; i++) {
+        unsigned mask = (unsigned)0 - (b >> i & 1);
+        value ^= (unsigned)a << i & mask;
+    }
+    // take module
+    for (unsigned i = 6; i < 8; i--) {
+        unsigned mask = (unsigned)0 - (value >> (i + 8) & 1);
+        value ^= poly << i & mask;
+    }
+    return value;
+}
+
+// the constants MixColumns and InvMixColumns multiply by
+static const uint8_t MIX_FACTORS[] = { 0x02, 0x03, 0x09, 0x0b, 0x0d, 0x0e };
+#define MIX_FACTORS_COUNT (sizeof(MIX_FACTORS) / sizeof(MIX_FACTORS[0]))
+
+static uint8_t ff_inv[256];
+static uint8_t sbox[256];
+static uint8_t sbox_inv[256];
+static uint32_t rcon[RCON_COUNT];
+static uint32_t te_tbl[4][256];
+static uint32_t td_tbl[4][256];
+
+static void init_ff() {
+    for (unsigned i = 1; i < 256; i++) {
+        for (unsigned j = 1; j < 256; j++) {
+            if (ff_mult_dumm(i, j) == 1) {
+                ff_inv[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+static void init_sbox() {
+    for (size_t i = 0; i < 256; i++) {
+        unsigned b = ff_inv[i];
+        unsigned raw_v = 0x63 ^ b ^ (b << 1) ^ (b << 2) ^ (b << 3) ^ (b << 4);
+        raw_v ^= (raw_v >> 8);
+        sbox[i] = raw_v;
+        sbox_inv[sbox[i]] = i;
+    }
+}
+
+static void init_rcon() {
+    uint8_t x_i = 1;
+    for (size_t i = 0; i < RCON_COUNT; i++) {
+        rcon[i] = (uint32_t)x_i << 24;
+        x_i = ff_mult_dumm(0x02, x_i);
+    }
+}
+
+// columns are words in memory order, row 0 in the low byte, so the tables
+// are for a little-endian target
+static void init_ttables() {
+    for (size_t i = 0; i < 256; i++) {
+        uint8_t s = sbox[i];
+        uint8_t v = sbox_inv[i];
+        uint32_t te = ff_mult_dumm(0x02, s) | (uint32_t)s << 8 | (uint32_t)s << 16 | (uint32_t)ff_mult_dumm(0x03, s) << 24;
+        uint32_t td = ff_mult_dumm(0x0e, v) | (uint32_t)ff_mult_dumm(0x09, v) << 8
+            | (uint32_t)ff_mult_dumm(0x0d, v) << 16 | (uint32_t)ff_mult_dumm(0x0b, v) << 24;
+        for (size_t r = 0; r < 4; r++) {
+            te_tbl[r][i] = te;
+            td_tbl[r][i] = td;
+            te = te << 8 | te >> 24;
+            td = td << 8 | td >> 24;
+        }
+    }
+}
+
+// the nibble lookups of the vperm backend of lab2, see it for the method
+// GF(16) modulo x^4 + x + 1, x generates it
+#define VPERM_GF16_POLY 0x13
+// log of 0, any sum with it keeps the top bit and looks up as 0
+#define VPERM_LOG_ZERO 0xF0
+
+enum {
+    VPERM_LOG,
+    VPERM_EXP,
+    VPERM_LOG_INV,
+    VPERM_SQUARE,
+    VPERM_LAMBDA_SQUARE,
+    VPERM_ENC_IN_LO,
+    VPERM_ENC_IN_HI,
+    VPERM_ENC_OUT_LO,
+    VPERM_ENC_OUT_HI,
+    VPERM_DEC_IN_LO,
+    VPERM_DEC_IN_HI,
+    VPERM_DEC_OUT_LO,
+    VPERM_DEC_OUT_HI,
+    VPERM_TABLES
+};
+
+static const char* VPERM_NAMES[VPERM_TABLES] = {
+    "VPERM_LOG",
+    "VPERM_EXP",
+    "VPERM_LOG_INV",
+    "VPERM_SQUARE",
+    "VPERM_LAMBDA_SQUARE",
+    "VPERM_ENC_IN_LO",
+    "VPERM_ENC_IN_HI",
+    "VPERM_ENC_OUT_LO",
+    "VPERM_ENC_OUT_HI",
+    "VPERM_DEC_IN_LO",
+    "VPERM_DEC_IN_HI",
+    "VPERM_DEC_OUT_LO",
+    "VPERM_DEC_OUT_HI",
+};
+
+static uint8_t vperm_tbl[VPERM_TABLES][16];
+
+static uint8_t gf16_mult(uint8_t a, uint8_t b) {
+    uint8_t value = 0;
+    for (unsigned i = 0; i < 4; i++) {
+        if (b >> i & 1) value ^= a << i;
+    }
+    for (unsigned i = 3; i < 4; i--) {
+        if (value >> (i + 4) & 1) value ^= VPERM_GF16_POLY << i;
+    }
+    return value;
+}
+
+// bytes of the tower field are a_h << 4 | a_l
+static uint8_t tower_mult(uint8_t a, uint8_t b, uint8_t lambda) {
+    uint8_t ah = a >> 4, al = a & 0xF, bh = b >> 4, bl = b & 0xF;
+    uint8_t hh = gf16_mult(ah, bh);
+    uint8_t high = hh ^ gf16_mult(ah, bl) ^ gf16_mult(al, bh);
+    uint8_t low = gf16_mult(hh, lambda) ^ gf16_mult(al, bl);
+    return high << 4 | low;
+}
+
+// lookups of an affine byte map f for the low and the high nibble,
+// f(0) goes to the low one
+static void vperm_split_affine(uint8_t* lo, uint8_t* hi, const uint8_t* f) {
+    for (size_t n = 0; n < 16; n++) {
+        lo[n] = f[n];
+        hi[n] = f[n << 4] ^ f[0];
+    }
+}
+
+static void init_vperm() {
+    uint8_t* log_tbl = vperm_tbl[VPERM_LOG];
+    uint8_t* exp_tbl = vperm_tbl[VPERM_EXP];
+    uint8_t power = 1;
+    log_tbl[0] = VPERM_LOG_ZERO;
+    exp_tbl[15] = 0;
+    for (uint8_t i = 0; i < 15; i++) {
+        exp_tbl[i] = power;
+        log_tbl[power] = i;
+        power = gf16_mult(power, 2);
+    }
+    // y^2 + y + l is irreducible when no t has t^2 + t = l
+    uint8_t lambda = 1;
+    for (;; lambda++) {
+        bool root = false;
+        for (uint8_t t = 0; t < 16; t++) root = root || (gf16_mult(t, t) ^ t) == lambda;
+        if (!root) break;
+    }
+    for (uint8_t n = 0; n < 16; n++) {
+        uint8_t square = gf16_mult(n, n);
+        vperm_tbl[VPERM_LOG_INV][n] = n == 0 ? VPERM_LOG_ZERO : (15 - log_tbl[n]) % 15;
+        vperm_tbl[VPERM_SQUARE][n] = square;
+        vperm_tbl[VPERM_LAMBDA_SQUARE][n] = gf16_mult(lambda, square);
+    }
+
+    // the image of x (0x02) is a root of x^8 + x^4 + x^3 + x + 1 in the
+    // tower field, and to_tower maps the powers of x to powers of the root
+    uint8_t root = 0;
+    for (unsigned r = 2; r < 256; r++) {
+        uint8_t p[9];
+        p[0] = 1;
+        for (size_t i = 1; i <= 8; i++) p[i] = tower_mult(p[i - 1], (uint8_t)r, lambda);
+        if ((p[8] ^ p[4] ^ p[3] ^ p[1] ^ p[0]) == 0) {
+            root = (uint8_t)r;
+            break;
+        }
+    }
+    uint8_t to_tower[256];
+    uint8_t from_tower[256];
+    uint8_t basis[8];
+    basis[0] = 1;
+    for (size_t i = 1; i < 8; i++) basis[i] = tower_mult(basis[i - 1], root, lambda);
+    for (unsigned v = 0; v < 256; v++) {
+        uint8_t t = 0;
+        for (size_t i = 0; i < 8; i++) {
+            if (v >> i & 1) t ^= basis[i];
+        }
+        to_tower[v] = t;
+        from_tower[t] = (uint8_t)v;
+    }
+
+    // sbox(x) = A(inv(x)) ^ 0x63 and sbox_inv(x) = inv(A^-1(x ^ 0x63)),
+    // with inv(y) going through the tower field
+    uint8_t enc_in[256], enc_out[256], dec_in[256], dec_out[256];
+    for (unsigned v = 0; v < 256; v++) {
+        enc_in[v] = to_tower[v];
+        enc_out[v] = sbox[ff_inv[from_tower[v]]];
+        dec_in[v] = to_tower[ff_inv[sbox_inv[v]]];
+        dec_out[v] = from_tower[v];
+    }
+    vperm_split_affine(vperm_tbl[VPERM_ENC_IN_LO], vperm_tbl[VPERM_ENC_IN_HI], enc_in);
+    vperm_split_affine(vperm_tbl[VPERM_ENC_OUT_LO], vperm_tbl[VPERM_ENC_OUT_HI], enc_out);
+    vperm_split_affine(vperm_tbl[VPERM_DEC_IN_LO], vperm_tbl[VPERM_DEC_IN_HI], dec_in);
+    vperm_split_affine(vperm_tbl[VPERM_DEC_OUT_LO], vperm_tbl[VPERM_DEC_OUT_HI], dec_out);
+}
+
+static void print_bytes(const char* name, const uint8_t* table) {
+    printf("static const uint8_t %s[256] = {", name);
+    for (size_t i = 0; i < 256; i++) {
+        printf(i % 16 == 0 ? "\n    0x%02X," : " 0x%02X,", table[i]);
+    }
+    printf("\n};\n\n");
+}
+
+static void print_words(const uint32_t* table, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        printf(i % 8 == 0 ? "\n    0x%08X," : " 0x%08X,", table[i]);
+    }
+}
+
+// the tables behind the enum of their indices, for SSE2 targets only
+static void print_vperm() {
+    printf("#ifdef __SSE2__\n\nenum {\n");
+    for (size_t t = 0; t < VPERM_TABLES; t++) printf("    %s,\n", VPERM_NAMES[t]);
+    printf("    VPERM_TABLES\n};\n\n");
+    printf("_Alignas(16) static const uint8_t vperm_tbl[VPERM_TABLES][16] = {\n");
+    for (size_t t = 0; t < VPERM_TABLES; t++) {
+        printf("    {");
+        for (size_t i = 0; i < 16; i++) printf(i == 0 ? " 0x%02X," : " 0x%02X,", vperm_tbl[t][i]);
+        printf(" }, // %s\n", VPERM_NAMES[t]);
+    }
+    printf("};\n\n#endif//__SSE2__\n\n");
+}
+
+static void print_ttable(const char* name, uint32_t (*table)[256]) {
+    printf("_Alignas(64) static const uint32_t %s[4][256] = {", name);
+    for (size_t r = 0; r < 4; r++) {
+        printf("\n  {");
+        print_words(table[r], 256);
+        printf("\n  },");
+    }
+    printf("\n};\n\n");
+}
+
+int main() {
+    init_ff();
+    init_sbox();
+    init_rcon();
+    init_ttables();
+    init_vperm();
+
+    printf("// generated by labs/lab2/gen_tables.c, do not edit\n\n");
+    printf("#ifndef LAB2_TABLES_INCLUDE\n#define LAB2_TABLES_INCLUDE\n\n");
+    printf("#include <stdint.h>\n\n");
+    print_bytes("ff_inv", ff_inv);
+    print_bytes("sbox", sbox);
+    print_bytes("sbox_inv", sbox_inv);
+    for (size_t f = 0; f < MIX_FACTORS_COUNT; f++) {
+        uint8_t table[256];
+        for (unsigned i = 0; i < 256; i++) table[i] = ff_mult_dumm(MIX_FACTORS[f], i);
+        char name[16];
+        snprintf(name, sizeof(name), "ff_mult_%02x", MIX_FACTORS[f]);
+        print_bytes(name, table);
+    }
+    printf("static const uint32_t rcon[%d] = {", RCON_COUNT);
+    print_words(rcon, RCON_COUNT);
+    printf("\n};\n\n");
+    print_ttable("te_tbl", te_tbl);
+    print_ttable("td_tbl", td_tbl);
+    print_vperm();
+    printf("#endif//LAB2_TABLES_INCLUDE\n");
+    return 0;
+}
@@ -1,9 +1,21 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include <labs_random.h>
+#include <lab2_tables.h>
 
 #define MAX_AES_ROUNDS 32
 
@@ -62,69 +74,14 @@ static void display_block(Block* block) {
     putchar('\n');
 }
 
-// in GF(2^8) with polynomial x^8 + x^4 + x^3 + x + 1
+// sbox, sbox_inv, rcon, the MixColumns multiples and the T-tables are
+// generated at build time by gen_tables.c. T-tables: SubBytes, ShiftRows and
+// MixColumns of a whole round in four lookups per column. te_tbl[r][x] is
+// the column MixColumns makes of sbox[x] in row r, td_tbl[r][x] the same for
+// sbox_inv and InvMixColumns. Columns are words in memory order, row 0 in the
+// low byte (little-endian host)
 
-uint8_t ff_mult_dumm(uint8_t a, uint8_t b) {
-    const unsigned poly = (unsigned)0b100011011; // x^8 + x^4 + x^3 + x + 1
-    unsigned value = 0;
-    // multiply
-    for (unsigned i = 0; i < 8; i++) {
-        unsigned mask = (unsigned)0 - (b >> i & 1);
-        value ^= (unsigned)a << i & mask;
-    }
-    // take module 
-    for (unsigned i = 6; i < 8; i--) {
-        unsigned mask = (unsigned)0 - (value >> (i + 8) & 1);
-        value ^= poly << i & mask;
-    }
-    return value;
-}
-
-uint8_t ff_mult_tbl[256][256];
-uint8_t ff_inv[256] = {0};
-uint8_t sbox[256];
-uint8_t sbox_inv[256];
-uint32_t rcon[MAX_AES_ROUNDS+1];
-
-static void init_ff() {
-    for (size_t i = 0; i < 256; i++) {
-        for (size_t j = i; j < 256; j++) {
-            uint8_t prod = ff_mult_dumm(i, j);
-
-            ff_mult_tbl[i][j] = prod;
-            ff_mult_tbl[j][i] = prod;
-
-            if (prod == 1) {
-                ff_inv[i] = j;
-                ff_inv[j] = i;
-            }
-        }
-    }
-}
-
-static void init_sbox() {
-    for (size_t i = 0; i < 256; i++) {
-        unsigned b = ff_inv[i];
-        unsigned raw_v = 0x63 ^ b ^ (b << 1) ^ (b << 2) ^ (b << 3) ^ (b << 4);
-        raw_v ^= (raw_v >> 8);
-        sbox[i] = raw_v;
-        sbox_inv[sbox[i]] = i;
-    }
-}
-
-static void init_rcon() {
-    uint8_t x_i = 1;
-    for (size_t i = 0; i <= MAX_AES_ROUNDS; i++) {
-        rcon[i] = (uint32_t)x_i << 24;
-        x_i = ff_mult_tbl[0x02][x_i];
-    }
-}
-
-static void init_tables() {
-    init_ff();
-    init_sbox();
-    init_rcon();
-}
+_Static_assert(sizeof(rcon) / sizeof(rcon[0]) == MAX_AES_ROUNDS + 1, "regenerate lab2_tables.h");
 
 static void display_table(const uint8_t* table) {
     for (size_t i = 0; i < 256; i++) {
@@ -195,10 +152,10 @@ void mix_columns(Block* state) {
         uint32_t b_word = 0;
         unsigned char* a = (unsigned char*)&state->w[i];
         unsigned char* b = (unsigned char*)&b_word;
-        b[0] = ff_mult_tbl[0x02][a[0]] ^ ff_mult_tbl[0x03][a[1]] ^ a[2] ^ a[3];
-        b[1] = ff_mult_tbl[0x02][a[1]] ^ ff_mult_tbl[0x03][a[2]] ^ a[3] ^ a[0];
-        b[2] = ff_mult_tbl[0x02][a[2]] ^ ff_mult_tbl[0x03][a[3]] ^ a[0] ^ a[1];
-        b[3] = ff_mult_tbl[0x02][a[3]] ^ ff_mult_tbl[0x03][a[0]] ^ a[1] ^ a[2];
+        b[0] = ff_mult_02[a[0]] ^ ff_mult_03[a[1]] ^ a[2] ^ a[3];
+        b[1] = ff_mult_02[a[1]] ^ ff_mult_03[a[2]] ^ a[3] ^ a[0];
+        b[2] = ff_mult_02[a[2]] ^ ff_mult_03[a[3]] ^ a[0] ^ a[1];
+        b[3] = ff_mult_02[a[3]] ^ ff_mult_03[a[0]] ^ a[1] ^ a[2];
         state->w[i] = b_word;
     }
 }
@@ -208,10 +165,10 @@ void inv_mix_columns(Block* state) {
         uint32_t b_word = 0;
         unsigned char* a = (unsigned char*)&state->w[i];
         unsigned char* b = (unsigned char*)&b_word;
-        b[0] = ff_mult_tbl[0x0e][a[0]] ^ ff_mult_tbl[0x0b][a[1]] ^ ff_mult_tbl[0x0d][a[2]] ^ ff_mult_tbl[0x09][a[3]];
-        b[1] = ff_mult_tbl[0x09][a[0]] ^ ff_mult_tbl[0x0e][a[1]] ^ ff_mult_tbl[0x0b][a[2]] ^ ff_mult_tbl[0x0d][a[3]];
-        b[2] = ff_mult_tbl[0x0d][a[0]] ^ ff_mult_tbl[0x09][a[1]] ^ ff_mult_tbl[0x0e][a[2]] ^ ff_mult_tbl[0x0b][a[3]];
-        b[3] = ff_mult_tbl[0x0b][a[0]] ^ ff_mult_tbl[0x0d][a[1]] ^ ff_mult_tbl[0x09][a[2]] ^ ff_mult_tbl[0x0e][a[3]];
+        b[0] = ff_mult_0e[a[0]] ^ ff_mult_0b[a[1]] ^ ff_mult_0d[a[2]] ^ ff_mult_09[a[3]];
+        b[1] = ff_mult_09[a[0]] ^ ff_mult_0e[a[1]] ^ ff_mult_0b[a[2]] ^ ff_mult_0d[a[3]];
+        b[2] = ff_mult_0d[a[0]] ^ ff_mult_09[a[1]] ^ ff_mult_0e[a[2]] ^ ff_mult_0b[a[3]];
+        b[3] = ff_mult_0b[a[0]] ^ ff_mult_0d[a[1]] ^ ff_mult_09[a[2]] ^ ff_mult_0e[a[3]];
         state->w[i] = b_word;
     }
 }
@@ -253,21 +210,27 @@ static uint32_t rot_word(uint32_t w) {
     return w << 8 | (w >> 24 & 0xFF);
 }
 
+// word i of a schedule, stored in memory order, as a number with the first
+// byte on top like the key words
+#define SCHEDULE_WORD(round_keys, i) u32_swap_bytes((round_keys)[(i) / 4].w[(i) % 4])
+#define SCHEDULE_SET_WORD(round_keys, i, v) ((round_keys)[(i) / 4].w[(i) % 4] = u32_swap_bytes(v))
+
+// writes rounds + 1 round keys and nothing else, the schedule is built in
+// place
 void key_expansion(const uint32_t* key, size_t key_len, Block* round_keys, size_t rounds) {
-    uint32_t w[4 * (MAX_AES_ROUNDS + 1)];
-    memcpy(w, key, 4 * key_len);
-    for (size_t i = key_len; i <= 4 * rounds; i++) {
-        uint32_t t = w[i-1];
+    assert(key_len <= 4 * (rounds + 1));
+    for (size_t i = 0; i < key_len; i++) {
+        SCHEDULE_SET_WORD(round_keys, i, key[i]);
+    }
+    for (size_t i = key_len; i < 4 * (rounds + 1); i++) {
+        uint32_t t = SCHEDULE_WORD(round_keys, i - 1);
         if (i % key_len == 0) {
             t = sub_word(rot_word(t));
             t ^= rcon[i / key_len - 1];
         } else if (key_len > 6 && i % key_len == 4) {
             t = sub_word(t);
         }
-        w[i] = t ^ w[i - key_len];
-    }
-    for (size_t i = 0; i <= MAX_AES_ROUNDS; i++) {
-        round_keys[i] = block_from_words_ne(&w[i * 4]);
+        SCHEDULE_SET_WORD(round_keys, i, t ^ SCHEDULE_WORD(round_keys, i - key_len));
     }
 }
 
@@ -284,164 +247,3277 @@ void cipher_block(Block* state, const Block* round_keys, size_t rounds) {
     add_round_key(state, &round_keys[rounds]);
 }
 
-void decipher_block(Block* state, const Block* round_keys, size_t rounds) {
-    add_round_key(state, &round_keys[rounds]);
-    for (size_t i = rounds-1; i > 0; i--) {
-        inv_shift_rows(state);
+// Decryption schedule of the equivalent inverse cipher (FIPS-197 5.3.5):
+// the round keys in reverse order, the middle ones through InvMixColumns.
+// InvMixColumns is linear, so it can run before AddRoundKey on the state
+// when it has run on the key, and decryption rounds take the shape of
+// encryption ones
+void inv_key_expansion(const Block* round_keys, size_t rounds, Block* dec_keys) {
+    dec_keys[0] = round_keys[rounds];
+    for (size_t i = 1; i < rounds; i++) {
+        dec_keys[i] = round_keys[rounds - i];
+        inv_mix_columns(&dec_keys[i]);
+    }
+    dec_keys[rounds] = round_keys[0];
+}
+
+// the equivalent inverse cipher, dec_keys from inv_key_expansion
+void decipher_block(Block* state, const Block* dec_keys, size_t rounds) {
+    add_round_key(state, &dec_keys[0]);
+    for (size_t i = 1; i < rounds; i++) {
         inv_sub_bytes(state);
-        add_round_key(state, &round_keys[i]);
+        inv_shift_rows(state);
         inv_mix_columns(state);
+        add_round_key(state, &dec_keys[i]);
     }
-    inv_shift_rows(state);
     inv_sub_bytes(state);
-    add_round_key(state, &round_keys[0]);
+    inv_shift_rows(state);
+    add_round_key(state, &dec_keys[rounds]);
 }
 
-static void show_test_vectors() {
-    // KEYS
+#define TT_BYTE(w, r) ((w) >> (8 * (r)) & 0xFF)
+#define TTABLE_LANES 4
 
-    //const uint32_t example_key[8] = {
-    //    0x603DEB10,
-    //    0x15CA71BE,
-    //    0x2B73AEF0,
-    //    0x857D7781,
-    //    0x1F352C07,
-    //    0x3B6108D7,
-    //    0x2D9810A3,
-    //    0x0914DFF4,
-    //};
-    //const uint32_t example_key[4] = {
-    //    0x00010203,
-    //    0x04050607,
-    //    0x08090a0b,
-    //    0x0c0d0e0f,
-    //};
-    //const uint32_t example_key[4] = {
-    //    0x2B7E1516,
-    //    0x28AED2A6,
-    //    0xABF71588,
-    //    0x09CF4F3C,
-    //};
-    const uint32_t example_key[8] = {
-        0x00010203,
-        0x04050607,
-        0x08090A0B,
-        0x0C0D0E0F,
-        0x10111213,
-        0x14151617,
-        0x18191A1B,
-        0x1C1D1E1F,
-    };
+// the round loops of the array functions get unrolled for the standard key
+// sizes when the round count is a constant
+#define AES_ROUNDS_DISPATCH(fn, rounds, ...) \
+    switch (rounds) { \
+    case 10: fn(__VA_ARGS__, 10); break; \
+    case 12: fn(__VA_ARGS__, 12); break; \
+    case 14: fn(__VA_ARGS__, 14); break; \
+    default: fn(__VA_ARGS__, rounds); break; \
+    }
 
-    // INPUTS
+#define ALWAYS_INLINE inline __attribute__((always_inline))
 
-    //const uint32_t example_input[4] = {
-    //    0x3243F6A8,
-    //    0x885A308D,
-    //    0x313198A2,
-    //    0xE0370734,
-    //};
-    const uint32_t example_input[4] = {
-        0x00112233,
-        0x44556677,
-        0x8899AABB,
-        0xCCDDEEFF,
-    };
+// column j of the next state takes row r from column j+r (ShiftRows)
+static ALWAYS_INLINE void ttable_round(const uint32_t* s, uint32_t* t, const uint32_t* k) {
+    t[0] = te_tbl[0][TT_BYTE(s[0], 0)] ^ te_tbl[1][TT_BYTE(s[1], 1)] ^ te_tbl[2][TT_BYTE(s[2], 2)] ^ te_tbl[3][TT_BYTE(s[3], 3)] ^ k[0];
+    t[1] = te_tbl[0][TT_BYTE(s[1], 0)] ^ te_tbl[1][TT_BYTE(s[2], 1)] ^ te_tbl[2][TT_BYTE(s[3], 2)] ^ te_tbl[3][TT_BYTE(s[0], 3)] ^ k[1];
+    t[2] = te_tbl[0][TT_BYTE(s[2], 0)] ^ te_tbl[1][TT_BYTE(s[3], 1)] ^ te_tbl[2][TT_BYTE(s[0], 2)] ^ te_tbl[3][TT_BYTE(s[1], 3)] ^ k[2];
+    t[3] = te_tbl[0][TT_BYTE(s[3], 0)] ^ te_tbl[1][TT_BYTE(s[0], 1)] ^ te_tbl[2][TT_BYTE(s[1], 2)] ^ te_tbl[3][TT_BYTE(s[2], 3)] ^ k[3];
+}
 
-    Block round_keys[MAX_AES_ROUNDS+1];
-    key_expansion(example_key, 8, round_keys, MAX_AES_ROUNDS);
-    //for (size_t i = 0; i <= MAX_AES_ROUNDS; i++) {
-    //    display_block(&round_keys[i]);
-    //}
-    
+// no MixColumns in the last round
+static ALWAYS_INLINE void ttable_last_round(const uint32_t* s, uint32_t* t, const uint32_t* k) {
+    t[0] = ((uint32_t)sbox[TT_BYTE(s[0], 0)] | (uint32_t)sbox[TT_BYTE(s[1], 1)] << 8 | (uint32_t)sbox[TT_BYTE(s[2], 2)] << 16 | (uint32_t)sbox[TT_BYTE(s[3], 3)] << 24) ^ k[0];
+    t[1] = ((uint32_t)sbox[TT_BYTE(s[1], 0)] | (uint32_t)sbox[TT_BYTE(s[2], 1)] << 8 | (uint32_t)sbox[TT_BYTE(s[3], 2)] << 16 | (uint32_t)sbox[TT_BYTE(s[0], 3)] << 24) ^ k[1];
+    t[2] = ((uint32_t)sbox[TT_BYTE(s[2], 0)] | (uint32_t)sbox[TT_BYTE(s[3], 1)] << 8 | (uint32_t)sbox[TT_BYTE(s[0], 2)] << 16 | (uint32_t)sbox[TT_BYTE(s[1], 3)] << 24) ^ k[2];
+    t[3] = ((uint32_t)sbox[TT_BYTE(s[3], 0)] | (uint32_t)sbox[TT_BYTE(s[0], 1)] << 8 | (uint32_t)sbox[TT_BYTE(s[1], 2)] << 16 | (uint32_t)sbox[TT_BYTE(s[2], 3)] << 24) ^ k[3];
+}
 
-    Block state = block_from_words_ne(example_input);
-    printf("Initial: ");
-    display_block(&state);
+// the equivalent inverse cipher, so the rounds are te_tbl ones with td_tbl,
+// column j of the next state takes row r from column j-r (InvShiftRows)
+static ALWAYS_INLINE void ttable_inv_round(const uint32_t* s, uint32_t* t, const uint32_t* k) {
+    t[0] = td_tbl[0][TT_BYTE(s[0], 0)] ^ td_tbl[1][TT_BYTE(s[3], 1)] ^ td_tbl[2][TT_BYTE(s[2], 2)] ^ td_tbl[3][TT_BYTE(s[1], 3)] ^ k[0];
+    t[1] = td_tbl[0][TT_BYTE(s[1], 0)] ^ td_tbl[1][TT_BYTE(s[0], 1)] ^ td_tbl[2][TT_BYTE(s[3], 2)] ^ td_tbl[3][TT_BYTE(s[2], 3)] ^ k[1];
+    t[2] = td_tbl[0][TT_BYTE(s[2], 0)] ^ td_tbl[1][TT_BYTE(s[1], 1)] ^ td_tbl[2][TT_BYTE(s[0], 2)] ^ td_tbl[3][TT_BYTE(s[3], 3)] ^ k[2];
+    t[3] = td_tbl[0][TT_BYTE(s[3], 0)] ^ td_tbl[1][TT_BYTE(s[2], 1)] ^ td_tbl[2][TT_BYTE(s[1], 2)] ^ td_tbl[3][TT_BYTE(s[0], 3)] ^ k[3];
+}
+
+static ALWAYS_INLINE void ttable_inv_last_round(const uint32_t* s, uint32_t* t, const uint32_t* k) {
+    t[0] = ((uint32_t)sbox_inv[TT_BYTE(s[0], 0)] | (uint32_t)sbox_inv[TT_BYTE(s[3], 1)] << 8 | (uint32_t)sbox_inv[TT_BYTE(s[2], 2)] << 16 | (uint32_t)sbox_inv[TT_BYTE(s[1], 3)] << 24) ^ k[0];
+    t[1] = ((uint32_t)sbox_inv[TT_BYTE(s[1], 0)] | (uint32_t)sbox_inv[TT_BYTE(s[0], 1)] << 8 | (uint32_t)sbox_inv[TT_BYTE(s[3], 2)] << 16 | (uint32_t)sbox_inv[TT_BYTE(s[2], 3)] << 24) ^ k[1];
+    t[2] = ((uint32_t)sbox_inv[TT_BYTE(s[2], 0)] | (uint32_t)sbox_inv[TT_BYTE(s[1], 1)] << 8 | (uint32_t)sbox_inv[TT_BYTE(s[0], 2)] << 16 | (uint32_t)sbox_inv[TT_BYTE(s[3], 3)] << 24) ^ k[2];
+    t[3] = ((uint32_t)sbox_inv[TT_BYTE(s[3], 0)] | (uint32_t)sbox_inv[TT_BYTE(s[2], 1)] << 8 | (uint32_t)sbox_inv[TT_BYTE(s[1], 2)] << 16 | (uint32_t)sbox_inv[TT_BYTE(s[0], 3)] << 24) ^ k[3];
+}
 
-    cipher_block(&state, round_keys, 14);
-    printf("Encrypted: ");
-    display_block(&state);
+// `lanes` blocks side by side, their lookups independent of each other.
+// keys is the encryption or the decryption schedule to match the rounds
+static ALWAYS_INLINE void ttable_lanes(Block* blocks, size_t lanes, const Block* keys, bool inverse, size_t rounds) {
+    uint32_t s[TTABLE_LANES][4];
+    uint32_t t[TTABLE_LANES][4];
+    for (size_t j = 0; j < lanes; j++) {
+        for (size_t c = 0; c < 4; c++) s[j][c] = blocks[j].w[c] ^ keys[0].w[c];
+    }
+    // two rounds a step so the state and the temporary swap roles
+    size_t i = 1;
+    for (; i + 1 < rounds; i += 2) {
+        #pragma GCC unroll 4
+        for (size_t j = 0; j < lanes; j++) {
+            if (inverse) {
+                ttable_inv_round(s[j], t[j], keys[i].w);
+                ttable_inv_round(t[j], s[j], keys[i + 1].w);
+            } else {
+                ttable_round(s[j], t[j], keys[i].w);
+                ttable_round(t[j], s[j], keys[i + 1].w);
+            }
+        }
+    }
+    if (i < rounds) {
+        for (size_t j = 0; j < lanes; j++) {
+            if (inverse) {
+                ttable_inv_round(s[j], t[j], keys[i].w);
+            } else {
+                ttable_round(s[j], t[j], keys[i].w);
+            }
+        }
+        memcpy(s, t, sizeof(s[0]) * lanes);
+    }
+    for (size_t j = 0; j < lanes; j++) {
+        if (inverse) {
+            ttable_inv_last_round(s[j], blocks[j].w, keys[rounds].w);
+        } else {
+            ttable_last_round(s[j], blocks[j].w, keys[rounds].w);
+        }
+    }
+}
 
-    decipher_block(&state, round_keys, 14);
-    printf("Decrypted: ");
-    display_block(&state);
+void ttable_cipher_block(Block* state, const Block* round_keys, size_t rounds) {
+    ttable_lanes(state, 1, round_keys, false, rounds);
+}
 
+void ttable_decipher_block(Block* state, const Block* dec_keys, size_t rounds) {
+    ttable_lanes(state, 1, dec_keys, true, rounds);
 }
 
-static uint32_t u32_popcount_dumm(uint32_t w) {
-    uint32_t count = 0;
-    while (w != 0) {
-        w &= w - 1;
-        count += 1;
+// ECB over an array, TTABLE_LANES blocks at a time
+static ALWAYS_INLINE void ttable_blocks(Block* blocks, size_t count, const Block* keys, bool inverse, size_t rounds) {
+    size_t b = 0;
+    for (; b + TTABLE_LANES <= count; b += TTABLE_LANES) {
+        ttable_lanes(&blocks[b], TTABLE_LANES, keys, inverse, rounds);
+    }
+    for (; b < count; b++) {
+        ttable_lanes(&blocks[b], 1, keys, inverse, rounds);
     }
-    return count;
 }
 
-static uint32_t block_diff_bits_count(const Block* a, const Block* b) {
-    uint32_t count = 0;
-    for (size_t i = 0; i < 4; i++) {
-        count += u32_popcount_dumm(a->w[i] ^ b->w[i]);
+void ttable_cipher_blocks(Block* blocks, size_t count, const Block* round_keys, size_t rounds) {
+    AES_ROUNDS_DISPATCH(ttable_blocks, rounds, blocks, count, round_keys, false);
+}
+
+void ttable_decipher_blocks(Block* blocks, size_t count, const Block* dec_keys, size_t rounds) {
+    AES_ROUNDS_DISPATCH(ttable_blocks, rounds, blocks, count, dec_keys, true);
+}
+
+#ifdef __SSE2__
+// AES-NI: a round is one instruction. The functions are compiled for AES-NI
+// whatever the build flags and only called when cpuid reports it. A Block is
+// the AES byte order in memory, so round keys load as they are.
+
+#define AESNI_TARGET __attribute__((target("aes,ssse3")))
+// aesenc has a latency of several cycles but issues every cycle or two,
+// so independent blocks go through the rounds side by side
+#define AESNI_LANES 8
+
+static bool aesni_supported() {
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3");
+}
+
+// SubWord(RotWord(w3)) ^ rcon in every column: all columns are equal, so
+// ShiftRows in aesenclast does nothing and only SubBytes and the key remain
+AESNI_TARGET static __m128i aesni_expand_step(__m128i prev, __m128i last, uint32_t rcon_byte, bool rot) {
+    __m128i word = rot
+        ? _mm_shuffle_epi8(last, _mm_set_epi8(12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13, 12, 15, 14, 13))
+        : _mm_shuffle_epi32(last, 0xFF);
+    __m128i t = _mm_aesenclast_si128(word, _mm_set1_epi32((int)rcon_byte));
+    // w[i] ^= w[i-1] for the four words of the step
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 8));
+    return _mm_xor_si128(prev, t);
+}
+
+AESNI_TARGET static uint32_t aesni_sub_word(uint32_t w) {
+    return (uint32_t)_mm_cvtsi128_si32(_mm_aesenclast_si128(_mm_set1_epi32((int)w), _mm_setzero_si128()));
+}
+
+// same schedule as key_expansion, four words per step for 128 and 256-bit
+// keys, the word by word loop with SubWord in aesenclast for the others
+AESNI_TARGET void aesni_key_expansion(const uint32_t* key, size_t key_len, Block* round_keys, size_t rounds) {
+    // key words are numbers with the first byte on top
+    const __m128i swap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    if (key_len == 4) {
+        __m128i k = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)key), swap);
+        _mm_storeu_si128((__m128i*)&round_keys[0], k);
+        for (size_t i = 1; i <= rounds; i++) {
+            k = aesni_expand_step(k, k, rcon[i - 1] >> 24, true);
+            _mm_storeu_si128((__m128i*)&round_keys[i], k);
+        }
+        return;
+    }
+    if (key_len == 8) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)key), swap);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(key + 4)), swap);
+        _mm_storeu_si128((__m128i*)&round_keys[0], a);
+        if (rounds >= 1) _mm_storeu_si128((__m128i*)&round_keys[1], b);
+        for (size_t i = 2; i <= rounds; i += 2) {
+            a = aesni_expand_step(a, b, rcon[i / 2 - 1] >> 24, true);
+            _mm_storeu_si128((__m128i*)&round_keys[i], a);
+            if (i + 1 > rounds) break;
+            b = aesni_expand_step(b, a, 0, false);
+            _mm_storeu_si128((__m128i*)&round_keys[i + 1], b);
+        }
+        return;
+    }
+    for (size_t i = 0; i < key_len; i++) {
+        SCHEDULE_SET_WORD(round_keys, i, key[i]);
+    }
+    for (size_t i = key_len; i < 4 * (rounds + 1); i++) {
+        uint32_t t = SCHEDULE_WORD(round_keys, i - 1);
+        if (i % key_len == 0) {
+            t = aesni_sub_word(rot_word(t)) ^ rcon[i / key_len - 1];
+        } else if (key_len > 6 && i % key_len == 4) {
+            t = aesni_sub_word(t);
+        }
+        SCHEDULE_SET_WORD(round_keys, i, t ^ SCHEDULE_WORD(round_keys, i - key_len));
     }
-    return count;
 }
 
-#define NUM_TESTS 100000
-#define ROUNDS_MIN 1
-#define ROUNDS_MAX 18
-#define ROUNDS_STEP 1
+AESNI_TARGET void aesni_cipher_block(Block* state, const Block* round_keys, size_t rounds) {
+    __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*)state), _mm_loadu_si128((const __m128i*)&round_keys[0]));
+    for (size_t i = 1; i < rounds; i++) {
+        s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i*)&round_keys[i]));
+    }
+    s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i*)&round_keys[rounds]));
+    _mm_storeu_si128((__m128i*)state, s);
+}
 
-void lab_task() {
-    uint32_t random_state = 42;
-    uint32_t buf[8];
-    Block round_keys[MAX_AES_ROUNDS+1];
-    
-    for (size_t round_count = ROUNDS_MIN; round_count <= ROUNDS_MAX; round_count += ROUNDS_STEP) {
-        double flip_average_a = 0.;
-        double flip_average_b = 0.;
-        for (size_t t = 0; t < NUM_TESTS; t++) {
-            // random state
-            for (size_t i = 0; i < 4; i++) buf[i] = xorshift_next(&random_state);
-            Block state_orig = block_from_words_ne(buf);
-            // random key
-            uint32_t key[4];
-            for (size_t i = 0; i < 4; i++) key[i] = xorshift_next(&random_state);
+// inv_key_expansion with aesimc
+AESNI_TARGET void aesni_inv_key_expansion(const Block* round_keys, size_t rounds, Block* dec_keys) {
+    dec_keys[0] = round_keys[rounds];
+    for (size_t i = 1; i < rounds; i++) {
+        __m128i k = _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)&round_keys[rounds - i]));
+        _mm_storeu_si128((__m128i*)&dec_keys[i], k);
+    }
+    dec_keys[rounds] = round_keys[0];
+}
 
-            // trivial case
-            Block state_trivial = state_orig;
-            key_expansion(key, 4, round_keys, round_count);
-            cipher_block(&state_trivial, round_keys, round_count);
+// aesdec is the equivalent inverse cipher round
+AESNI_TARGET void aesni_decipher_block(Block* state, const Block* dec_keys, size_t rounds) {
+    __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*)state), _mm_loadu_si128((const __m128i*)&dec_keys[0]));
+    for (size_t i = 1; i < rounds; i++) {
+        s = _mm_aesdec_si128(s, _mm_loadu_si128((const __m128i*)&dec_keys[i]));
+    }
+    s = _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i*)&dec_keys[rounds]));
+    _mm_storeu_si128((__m128i*)state, s);
+}
 
-            // a) flip single state bit
-            Block state_a = state_orig;
-            uint32_t aflip_at = xorshift_next(&random_state) & 127;
-            state_a.w[aflip_at >> 5] ^= 1 << (aflip_at & 31);
-            cipher_block(&state_a, round_keys, round_count);
+// ECB over an array, AESNI_LANES blocks at a time
+AESNI_TARGET static ALWAYS_INLINE void aesni_encrypt_blocks(Block* blocks, size_t count, const Block* round_keys, size_t rounds) {
+    __m128i k[MAX_AES_ROUNDS + 1];
+    for (size_t i = 0; i <= rounds; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)&round_keys[i]);
+    }
+    size_t b = 0;
+    for (; b + AESNI_LANES <= count; b += AESNI_LANES) {
+        __m128i s[AESNI_LANES];
+        for (size_t j = 0; j < AESNI_LANES; j++) {
+            s[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[b + j]), k[0]);
+        }
+        for (size_t i = 1; i < rounds; i++) {
+            // unrolled, so the lanes stay in registers
+            #pragma GCC unroll 8
+            for (size_t j = 0; j < AESNI_LANES; j++) s[j] = _mm_aesenc_si128(s[j], k[i]);
+        }
+        for (size_t j = 0; j < AESNI_LANES; j++) {
+            _mm_storeu_si128((__m128i*)&blocks[b + j], _mm_aesenclast_si128(s[j], k[rounds]));
+        }
+    }
+    for (; b < count; b++) {
+        __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[b]), k[0]);
+        for (size_t i = 1; i < rounds; i++) s = _mm_aesenc_si128(s, k[i]);
+        _mm_storeu_si128((__m128i*)&blocks[b], _mm_aesenclast_si128(s, k[rounds]));
+    }
+}
 
-            // b) flip single key bit
-            Block state_b = state_orig;
-            uint32_t bflip_at = xorshift_next(&random_state) & 127;
-            key[bflip_at >> 5] ^= 1 << (bflip_at & 31);
-            key_expansion(key, 4, round_keys, round_count);
-            cipher_block(&state_b, round_keys, round_count);
-
-            flip_average_a += (double)block_diff_bits_count(&state_trivial, &state_a);
-            flip_average_b += (double)block_diff_bits_count(&state_trivial, &state_b);
-        }
-        flip_average_a /= (double)NUM_TESTS;
-        flip_average_b /= (double)NUM_TESTS;
-            
-        printf("\n\n round count = %zu\n", round_count);
-        printf("a) av. flipped %.2lf/128 = %.8lf%%\n", flip_average_a, flip_average_a * (100. / 128.));
-        printf("b) av. flipped %.2lf/128 = %.8lf%%\n", flip_average_b, flip_average_b * (100. / 128.));
+AESNI_TARGET static ALWAYS_INLINE void aesni_decrypt_blocks(Block* blocks, size_t count, const Block* dec_keys, size_t rounds) {
+    __m128i k[MAX_AES_ROUNDS + 1];
+    for (size_t i = 0; i <= rounds; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)&dec_keys[i]);
+    }
+    size_t b = 0;
+    for (; b + AESNI_LANES <= count; b += AESNI_LANES) {
+        __m128i s[AESNI_LANES];
+        for (size_t j = 0; j < AESNI_LANES; j++) {
+            s[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[b + j]), k[0]);
+        }
+        for (size_t i = 1; i < rounds; i++) {
+            #pragma GCC unroll 8
+            for (size_t j = 0; j < AESNI_LANES; j++) s[j] = _mm_aesdec_si128(s[j], k[i]);
+        }
+        for (size_t j = 0; j < AESNI_LANES; j++) {
+            _mm_storeu_si128((__m128i*)&blocks[b + j], _mm_aesdeclast_si128(s[j], k[rounds]));
+        }
+    }
+    for (; b < count; b++) {
+        __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[b]), k[0]);
+        for (size_t i = 1; i < rounds; i++) s = _mm_aesdec_si128(s, k[i]);
+        _mm_storeu_si128((__m128i*)&blocks[b], _mm_aesdeclast_si128(s, k[rounds]));
     }
 }
 
-#ifndef LAB2_NOMAIN
-int main(int argc, const char** argv) {
-    init_tables();
-    //display_tables();
-    //show_test_vectors();
-    lab_task();
+AESNI_TARGET void aesni_cipher_blocks(Block* blocks, size_t count, const Block* round_keys, size_t rounds) {
+    AES_ROUNDS_DISPATCH(aesni_encrypt_blocks, rounds, blocks, count, round_keys);
+}
+
+AESNI_TARGET void aesni_decipher_blocks(Block* blocks, size_t count, const Block* dec_keys, size_t rounds) {
+    AES_ROUNDS_DISPATCH(aesni_decrypt_blocks, rounds, blocks, count, dec_keys);
+}
+
+// Bitsliced AES: 8 blocks as 8 bit planes, plane b holds bit b of every byte,
+// with byte i of the plane carrying the 8 blocks' byte i (block k in bit k).
+// SubBytes is a Boolean circuit over the planes, ShiftRows moves the 32-bit
+// columns of each plane and MixColumns rotates rows inside them, so nothing
+// is looked up by a secret index and the timing doesn't depend on the data.
+// Only SSE2 is used.
+
+#define BITSLICE_LANES 8
+
+// t = bits of a (shifted down by n) and b under mask trade places
+#define SWAPMOVE(a, b, mask, n) do { \
+    __m128i t = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(a, n), b), mask); \
+    b = _mm_xor_si128(b, t); \
+    a = _mm_xor_si128(a, _mm_slli_epi16(t, n)); \
+} while (0)
+
+// 8x8 bit transpose inside every byte position, blocks to planes and back.
+// Plane b ends up in q[b]
+static void bitslice_transpose(__m128i* q) {
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0F);
+    SWAPMOVE(q[0], q[1], m1, 1);
+    SWAPMOVE(q[2], q[3], m1, 1);
+    SWAPMOVE(q[4], q[5], m1, 1);
+    SWAPMOVE(q[6], q[7], m1, 1);
+    SWAPMOVE(q[0], q[2], m2, 2);
+    SWAPMOVE(q[1], q[3], m2, 2);
+    SWAPMOVE(q[4], q[6], m2, 2);
+    SWAPMOVE(q[5], q[7], m2, 2);
+    SWAPMOVE(q[0], q[4], m4, 4);
+    SWAPMOVE(q[1], q[5], m4, 4);
+    SWAPMOVE(q[2], q[6], m4, 4);
+    SWAPMOVE(q[3], q[7], m4, 4);
+}
+
+// the 113 gate S-box circuit of Boyar and Peralta, x0 is the top bit
+static void bitsliced_sub_bytes(__m128i* q) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    __m128i x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4];
+    __m128i x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+#define X(a, b) _mm_xor_si128(a, b)
+#define A(a, b) _mm_and_si128(a, b)
+    // top linear transformation
+    __m128i y14 = X(x3, x5);
+    __m128i y13 = X(x0, x6);
+    __m128i y9 = X(x0, x3);
+    __m128i y8 = X(x0, x5);
+    __m128i t0 = X(x1, x2);
+    __m128i y1 = X(t0, x7);
+    __m128i y4 = X(y1, x3);
+    __m128i y12 = X(y13, y14);
+    __m128i y2 = X(y1, x0);
+    __m128i y5 = X(y1, x6);
+    __m128i y3 = X(y5, y8);
+    __m128i t1 = X(x4, y12);
+    __m128i y15 = X(t1, x5);
+    __m128i y20 = X(t1, x1);
+    __m128i y6 = X(y15, x7);
+    __m128i y10 = X(y15, t0);
+    __m128i y11 = X(y20, y9);
+    __m128i y7 = X(x7, y11);
+    __m128i y17 = X(y10, y11);
+    __m128i y19 = X(y10, y8);
+    __m128i y16 = X(t0, y11);
+    __m128i y21 = X(y13, y16);
+    __m128i y18 = X(x0, y16);
+
+    // inversion in GF(2^8) over the tower field
+    __m128i t2 = A(y12, y15);
+    __m128i t3 = A(y3, y6);
+    __m128i t4 = X(t3, t2);
+    __m128i t5 = A(y4, x7);
+    __m128i t6 = X(t5, t2);
+    __m128i t7 = A(y13, y16);
+    __m128i t8 = A(y5, y1);
+    __m128i t9 = X(t8, t7);
+    __m128i t10 = A(y2, y7);
+    __m128i t11 = X(t10, t7);
+    __m128i t12 = A(y9, y11);
+    __m128i t13 = A(y14, y17);
+    __m128i t14 = X(t13, t12);
+    __m128i t15 = A(y8, y10);
+    __m128i t16 = X(t15, t12);
+    __m128i t17 = X(t4, t14);
+    __m128i t18 = X(t6, t16);
+    __m128i t19 = X(t9, t14);
+    __m128i t20 = X(t11, t16);
+    __m128i t21 = X(t17, y20);
+    __m128i t22 = X(t18, y19);
+    __m128i t23 = X(t19, y21);
+    __m128i t24 = X(t20, y18);
+
+    __m128i t25 = X(t21, t22);
+    __m128i t26 = A(t21, t23);
+    __m128i t27 = X(t24, t26);
+    __m128i t28 = A(t25, t27);
+    __m128i t29 = X(t28, t22);
+    __m128i t30 = X(t23, t24);
+    __m128i t31 = X(t22, t26);
+    __m128i t32 = A(t31, t30);
+    __m128i t33 = X(t32, t24);
+    __m128i t34 = X(t23, t33);
+    __m128i t35 = X(t27, t33);
+    __m128i t36 = A(t24, t35);
+    __m128i t37 = X(t36, t34);
+    __m128i t38 = X(t27, t36);
+    __m128i t39 = A(t29, t38);
+    __m128i t40 = X(t25, t39);
+
+    __m128i t41 = X(t40, t37);
+    __m128i t42 = X(t29, t33);
+    __m128i t43 = X(t29, t40);
+    __m128i t44 = X(t33, t37);
+    __m128i t45 = X(t42, t41);
+    __m128i z0 = A(t44, y15);
+    __m128i z1 = A(t37, y6);
+    __m128i z2 = A(t33, x7);
+    __m128i z3 = A(t43, y16);
+    __m128i z4 = A(t40, y1);
+    __m128i z5 = A(t29, y7);
+    __m128i z6 = A(t42, y11);
+    __m128i z7 = A(t45, y17);
+    __m128i z8 = A(t41, y10);
+    __m128i z9 = A(t44, y12);
+    __m128i z10 = A(t37, y3);
+    __m128i z11 = A(t33, y4);
+    __m128i z12 = A(t43, y13);
+    __m128i z13 = A(t40, y5);
+    __m128i z14 = A(t29, y2);
+    __m128i z15 = A(t42, y9);
+    __m128i z16 = A(t45, y14);
+    __m128i z17 = A(t41, y8);
+
+    // bottom linear transformation, the affine constant is in the negations
+    __m128i t46 = X(z15, z16);
+    __m128i t47 = X(z10, z11);
+    __m128i t48 = X(z5, z13);
+    __m128i t49 = X(z9, z10);
+    __m128i t50 = X(z2, z12);
+    __m128i t51 = X(z2, z5);
+    __m128i t52 = X(z7, z8);
+    __m128i t53 = X(z0, z3);
+    __m128i t54 = X(z6, z7);
+    __m128i t55 = X(z16, z17);
+    __m128i t56 = X(z12, t48);
+    __m128i t57 = X(t50, t53);
+    __m128i t58 = X(z4, t46);
+    __m128i t59 = X(z3, t54);
+    __m128i t60 = X(t46, t57);
+    __m128i t61 = X(z14, t57);
+    __m128i t62 = X(t52, t58);
+    __m128i t63 = X(t49, t58);
+    __m128i t64 = X(z4, t59);
+    __m128i t65 = X(t61, t62);
+    __m128i t66 = X(z1, t63);
+    __m128i s0 = X(t59, t63);
+    __m128i s6 = X(t56, X(t62, ones));
+    __m128i s7 = X(t48, X(t60, ones));
+    __m128i t67 = X(t64, t65);
+    __m128i s3 = X(t53, t66);
+    __m128i s4 = X(t51, t66);
+    __m128i s5 = X(t47, t65);
+    __m128i s1 = X(t64, X(s3, ones));
+    __m128i s2 = X(t55, X(t67, ones));
+#undef X
+#undef A
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+// the inverse of the S-box affine map (0x63 included)
+static void bitsliced_inv_affine(__m128i* q) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    __m128i b[8];
+    memcpy(b, q, sizeof(b));
+    for (size_t i = 0; i < 8; i++) {
+        __m128i v = _mm_xor_si128(_mm_xor_si128(b[(i + 2) % 8], b[(i + 5) % 8]), b[(i + 7) % 8]);
+        // the constant is 0x05
+        q[i] = i == 0 || i == 2 ? _mm_xor_si128(v, ones) : v;
+    }
+}
+
+// sbox_inv(x) = inv(A^-1(x)) and inv(y) = A^-1(sbox(y)), so the S-box
+// circuit serves both directions
+static void bitsliced_inv_sub_bytes(__m128i* q) {
+    bitsliced_inv_affine(q);
+    bitsliced_sub_bytes(q);
+    bitsliced_inv_affine(q);
+}
+
+// row r is byte r of every 32-bit column
+static __m128i bitsliced_rows(__m128i x, __m128i r1, __m128i r2, __m128i r3) {
+    const __m128i m0 = _mm_set1_epi32(0xFF);
+    const __m128i m1 = _mm_set1_epi32(0xFF00);
+    const __m128i m2 = _mm_set1_epi32(0xFF0000);
+    const __m128i m3 = _mm_set1_epi32((int)0xFF000000);
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(x, m0), _mm_and_si128(r1, m1)),
+                        _mm_or_si128(_mm_and_si128(r2, m2), _mm_and_si128(r3, m3)));
+}
+
+// row r of column c comes from column c+r
+static void bitsliced_shift_rows(__m128i* q) {
+    for (size_t b = 0; b < 8; b++) {
+        __m128i x = q[b];
+        q[b] = bitsliced_rows(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 3, 2, 1)),
+            _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)), _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 1, 0, 3)));
+    }
+}
+
+static void bitsliced_inv_shift_rows(__m128i* q) {
+    for (size_t b = 0; b < 8; b++) {
+        __m128i x = q[b];
+        q[b] = bitsliced_rows(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 1, 0, 3)),
+            _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)), _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 3, 2, 1)));
+    }
+}
+
+// row r takes row r+n of the same column
+static __m128i bitsliced_rot_rows(__m128i x, int n) {
+    return _mm_or_si128(_mm_srli_epi32(x, 8 * n), _mm_slli_epi32(x, 32 - 8 * n));
+}
+
+// multiplication by x of every byte: the planes move up a bit, the top one
+// comes back as 0x1B
+static void bitsliced_xtime(__m128i* out, const __m128i* a) {
+    __m128i top = a[7];
+    out[7] = a[6];
+    out[6] = a[5];
+    out[5] = a[4];
+    out[4] = _mm_xor_si128(a[3], top);
+    out[3] = _mm_xor_si128(a[2], top);
+    out[2] = a[1];
+    out[1] = _mm_xor_si128(a[0], top);
+    out[0] = top;
+}
+
+// with a1, a2, a3 the rows 1, 2, 3 further down the column:
+// 2a ^ 3a1 ^ a2 ^ a3 = xtime(a ^ a1) ^ a1 ^ (a2 ^ a3)
+static void bitsliced_mix_columns(__m128i* q) {
+    __m128i t[8];
+    __m128i r1[8];
+    __m128i x[8];
+    for (size_t b = 0; b < 8; b++) {
+        r1[b] = bitsliced_rot_rows(q[b], 1);
+        t[b] = _mm_xor_si128(q[b], r1[b]);
+    }
+    bitsliced_xtime(x, t);
+    for (size_t b = 0; b < 8; b++) {
+        q[b] = _mm_xor_si128(_mm_xor_si128(x[b], r1[b]), bitsliced_rot_rows(t[b], 2));
+    }
+}
+
+// InvMixColumns is MixColumns after the circulant (05 00 04 00),
+// that is a ^ 4 (a ^ a2)
+static void bitsliced_inv_mix_columns(__m128i* q) {
+    __m128i t[8];
+    __m128i x2[8];
+    __m128i x4[8];
+    for (size_t b = 0; b < 8; b++) {
+        t[b] = _mm_xor_si128(q[b], bitsliced_rot_rows(q[b], 2));
+    }
+    bitsliced_xtime(x2, t);
+    bitsliced_xtime(x4, x2);
+    for (size_t b = 0; b < 8; b++) {
+        q[b] = _mm_xor_si128(q[b], x4[b]);
+    }
+    bitsliced_mix_columns(q);
+}
+
+static void bitsliced_add_round_key(__m128i* q, const __m128i* k) {
+    for (size_t b = 0; b < 8; b++) {
+        q[b] = _mm_xor_si128(q[b], k[b]);
+    }
+}
+
+// every block sees the same round key: byte i of plane b is 0xFF where
+// bit b of key byte i is set. Shifting 16-bit lanes left by 7-b brings bit
+// b of each byte to its top bit
+void bitslice_round_keys(__m128i (*planes)[8], const Block* round_keys, size_t rounds) {
+    for (size_t i = 0; i <= rounds; i++) {
+        __m128i k = _mm_loadu_si128((const __m128i*)&round_keys[i]);
+        for (int b = 0; b < 8; b++) {
+            planes[i][b] = _mm_cmplt_epi8(_mm_sll_epi16(k, _mm_cvtsi32_si128(7 - b)), _mm_setzero_si128());
+        }
+    }
+}
+
+static void bitsliced_cipher8(Block* blocks, const __m128i (*keys)[8], size_t rounds) {
+    __m128i q[8];
+    for (size_t k = 0; k < 8; k++) q[k] = _mm_loadu_si128((const __m128i*)&blocks[k]);
+    bitslice_transpose(q);
+    bitsliced_add_round_key(q, keys[0]);
+    for (size_t i = 1; i < rounds; i++) {
+        bitsliced_sub_bytes(q);
+        bitsliced_shift_rows(q);
+        bitsliced_mix_columns(q);
+        bitsliced_add_round_key(q, keys[i]);
+    }
+    bitsliced_sub_bytes(q);
+    bitsliced_shift_rows(q);
+    bitsliced_add_round_key(q, keys[rounds]);
+    bitslice_transpose(q);
+    for (size_t k = 0; k < 8; k++) _mm_storeu_si128((__m128i*)&blocks[k], q[k]);
+}
+
+static void bitsliced_decipher8(Block* blocks, const __m128i (*keys)[8], size_t rounds) {
+    __m128i q[8];
+    for (size_t k = 0; k < 8; k++) q[k] = _mm_loadu_si128((const __m128i*)&blocks[k]);
+    bitslice_transpose(q);
+    bitsliced_add_round_key(q, keys[0]);
+    for (size_t i = 1; i < rounds; i++) {
+        bitsliced_inv_shift_rows(q);
+        bitsliced_inv_sub_bytes(q);
+        bitsliced_inv_mix_columns(q);
+        bitsliced_add_round_key(q, keys[i]);
+    }
+    bitsliced_inv_shift_rows(q);
+    bitsliced_inv_sub_bytes(q);
+    bitsliced_add_round_key(q, keys[rounds]);
+    bitslice_transpose(q);
+    for (size_t k = 0; k < 8; k++) _mm_storeu_si128((__m128i*)&blocks[k], q[k]);
+}
+
+// ECB over an array, a short last group runs padded
+static void bitsliced_blocks(Block* blocks, size_t count, const Block* round_keys, size_t rounds,
+                             void (*fn)(Block*, const __m128i (*)[8], size_t)) {
+    __m128i keys[MAX_AES_ROUNDS + 1][8];
+    bitslice_round_keys(keys, round_keys, rounds);
+    size_t b = 0;
+    for (; b + BITSLICE_LANES <= count; b += BITSLICE_LANES) {
+        fn(&blocks[b], (const __m128i (*)[8])keys, rounds);
+    }
+    if (b < count) {
+        Block tail[BITSLICE_LANES] = {0};
+        memcpy(tail, &blocks[b], sizeof(Block) * (count - b));
+        fn(tail, (const __m128i (*)[8])keys, rounds);
+        memcpy(&blocks[b], tail, sizeof(Block) * (count - b));
+    }
+}
+
+void bitsliced_cipher_blocks(Block* blocks, size_t count, const Block* round_keys, size_t rounds) {
+    bitsliced_blocks(blocks, count, round_keys, rounds, bitsliced_cipher8);
+}
+
+void bitsliced_decipher_blocks(Block* blocks, size_t count, const Block* dec_keys, size_t rounds) {
+    bitsliced_blocks(blocks, count, dec_keys, rounds, bitsliced_decipher8);
+}
+
+// a whole group of 8 for one block, there for the AesBackend interface
+void bitsliced_cipher_block(Block* state, const Block* round_keys, size_t rounds) {
+    bitsliced_cipher_blocks(state, 1, round_keys, rounds);
+}
+
+void bitsliced_decipher_block(Block* state, const Block* dec_keys, size_t rounds) {
+    bitsliced_decipher_blocks(state, 1, dec_keys, rounds);
+}
+
+// Vector permute AES (after Hamburg): one Block in an SSE register, SubBytes
+// computed with pshufb lookups into 16-entry registers only. The byte goes
+// through a field isomorphism into GF((2^4)^2) = GF(16)[y]/(y^2 + y + l),
+// where the inverse of a_h y + a_l is (a_h y + (a_h + a_l)) / d with
+// d = l a_h^2 + a_h a_l + a_l^2, so everything left is GF(16) arithmetic on
+// nibbles: products by log/antilog lookups, squares and inverses by lookups.
+// The affine maps in and out of the tower field are split into a lookup per
+// nibble. Nothing is indexed by memory address, so no cache-timing leak, and
+// unlike bitslicing one block is as fast as many.
+
+#define VPERM_TARGET __attribute__((target("ssse3")))
+
+// the nibble tables vperm_tbl and their VPERM_* indices are generated into
+// lab2_tables.h by gen_tables.c
+
+static bool vperm_supported() {
+    return __builtin_cpu_supports("ssse3");
+}
+
+#define VPERM_TABLE(i) _mm_load_si128((const __m128i*)vperm_tbl[i])
+
+// exp(la + lb mod 15): the minimum with the difference is the modulo for
+// unsigned bytes, and sums with VPERM_LOG_ZERO stay above 0x80
+VPERM_TARGET static __m128i vperm_mult_logs(__m128i exp_tbl, __m128i la, __m128i lb) {
+    __m128i s = _mm_adds_epu8(la, lb);
+    return _mm_shuffle_epi8(exp_tbl, _mm_min_epu8(s, _mm_sub_epi8(s, _mm_set1_epi8(15))));
+}
+
+// in and out pick the S-box or its inverse
+VPERM_TARGET static __m128i vperm_sub_bytes(__m128i x, size_t in, size_t out) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i log_tbl = VPERM_TABLE(VPERM_LOG);
+    const __m128i exp_tbl = VPERM_TABLE(VPERM_EXP);
+    __m128i lo = _mm_and_si128(x, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+    __m128i t = _mm_xor_si128(_mm_shuffle_epi8(VPERM_TABLE(in), lo), _mm_shuffle_epi8(VPERM_TABLE(in + 1), hi));
+    __m128i al = _mm_and_si128(t, nibble);
+    __m128i ah = _mm_and_si128(_mm_srli_epi16(t, 4), nibble);
+
+    __m128i log_ah = _mm_shuffle_epi8(log_tbl, ah);
+    __m128i d = _mm_xor_si128(_mm_shuffle_epi8(VPERM_TABLE(VPERM_LAMBDA_SQUARE), ah),
+                              _mm_shuffle_epi8(VPERM_TABLE(VPERM_SQUARE), al));
+    d = _mm_xor_si128(d, vperm_mult_logs(exp_tbl, log_ah, _mm_shuffle_epi8(log_tbl, al)));
+    __m128i log_inv_d = _mm_shuffle_epi8(VPERM_TABLE(VPERM_LOG_INV), d);
+    __m128i bh = vperm_mult_logs(exp_tbl, log_ah, log_inv_d);
+    __m128i bl = vperm_mult_logs(exp_tbl, _mm_shuffle_epi8(log_tbl, _mm_xor_si128(ah, al)), log_inv_d);
+    return _mm_xor_si128(_mm_shuffle_epi8(VPERM_TABLE(out), bl), _mm_shuffle_epi8(VPERM_TABLE(out + 1), bh));
+}
+
+// 2 x in every byte
+VPERM_TARGET static __m128i vperm_xtime(__m128i x) {
+    __m128i carry = _mm_and_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()), _mm_set1_epi8(0x1B));
+    return _mm_xor_si128(_mm_add_epi8(x, x), carry);
+}
+
+// row r takes row r+1 (r+2) of its column
+#define VPERM_ROT1 _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1)
+#define VPERM_ROT2 _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2)
+
+VPERM_TARGET static __m128i vperm_mix_columns(__m128i a) {
+    __m128i r1 = _mm_shuffle_epi8(a, VPERM_ROT1);
+    __m128i t = _mm_xor_si128(a, r1);
+    return _mm_xor_si128(_mm_xor_si128(vperm_xtime(t), r1), _mm_shuffle_epi8(t, VPERM_ROT2));
+}
+
+// MixColumns after the circulant (05 00 04 00)
+VPERM_TARGET static __m128i vperm_inv_mix_columns(__m128i a) {
+    __m128i t = _mm_xor_si128(a, _mm_shuffle_epi8(a, VPERM_ROT2));
+    return vperm_mix_columns(_mm_xor_si128(a, vperm_xtime(vperm_xtime(t))));
+}
+
+VPERM_TARGET void vperm_cipher_block(Block* state, const Block* round_keys, size_t rounds) {
+    // byte 4c + r comes from column c + r
+    const __m128i shift_rows = _mm_set_epi8(11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5, 0);
+    __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*)state), _mm_loadu_si128((const __m128i*)&round_keys[0]));
+    for (size_t i = 1; i < rounds; i++) {
+        s = _mm_shuffle_epi8(vperm_sub_bytes(s, VPERM_ENC_IN_LO, VPERM_ENC_OUT_LO), shift_rows);
+        s = _mm_xor_si128(vperm_mix_columns(s), _mm_loadu_si128((const __m128i*)&round_keys[i]));
+    }
+    s = _mm_shuffle_epi8(vperm_sub_bytes(s, VPERM_ENC_IN_LO, VPERM_ENC_OUT_LO), shift_rows);
+    s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i*)&round_keys[rounds]));
+    _mm_storeu_si128((__m128i*)state, s);
+}
+
+VPERM_TARGET void vperm_decipher_block(Block* state, const Block* dec_keys, size_t rounds) {
+    // byte 4c + r comes from column c - r
+    const __m128i inv_shift_rows = _mm_set_epi8(3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13, 0);
+    __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*)state), _mm_loadu_si128((const __m128i*)&dec_keys[0]));
+    for (size_t i = 1; i < rounds; i++) {
+        s = vperm_sub_bytes(_mm_shuffle_epi8(s, inv_shift_rows), VPERM_DEC_IN_LO, VPERM_DEC_OUT_LO);
+        s = _mm_xor_si128(vperm_inv_mix_columns(s), _mm_loadu_si128((const __m128i*)&dec_keys[i]));
+    }
+    s = vperm_sub_bytes(_mm_shuffle_epi8(s, inv_shift_rows), VPERM_DEC_IN_LO, VPERM_DEC_OUT_LO);
+    s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i*)&dec_keys[rounds]));
+    _mm_storeu_si128((__m128i*)state, s);
+}
+
+#define VPERM_LANES 4
+
+// ECB over an array, VPERM_LANES blocks at a time so the shuffles of one
+// block fill the latency of another's
+VPERM_TARGET void vperm_cipher_blocks(Block* blocks, size_t count, const Block* round_keys, size_t rounds) {
+    const __m128i shift_rows = _mm_set_epi8(11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5, 0);
+    size_t b = 0;
+    for (; b + VPERM_LANES <= count; b += VPERM_LANES) {
+        __m128i s[VPERM_LANES];
+        __m128i k = _mm_loadu_si128((const __m128i*)&round_keys[0]);
+        for (size_t j = 0; j < VPERM_LANES; j++) s[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[b + j]), k);
+        for (size_t i = 1; i < rounds; i++) {
+            k = _mm_loadu_si128((const __m128i*)&round_keys[i]);
+            #pragma GCC unroll 4
+            for (size_t j = 0; j < VPERM_LANES; j++) {
+                s[j] = _mm_shuffle_epi8(vperm_sub_bytes(s[j], VPERM_ENC_IN_LO, VPERM_ENC_OUT_LO), shift_rows);
+                s[j] = _mm_xor_si128(vperm_mix_columns(s[j]), k);
+            }
+        }
+        k = _mm_loadu_si128((const __m128i*)&round_keys[rounds]);
+        for (size_t j = 0; j < VPERM_LANES; j++) {
+            s[j] = _mm_shuffle_epi8(vperm_sub_bytes(s[j], VPERM_ENC_IN_LO, VPERM_ENC_OUT_LO), shift_rows);
+            _mm_storeu_si128((__m128i*)&blocks[b + j], _mm_xor_si128(s[j], k));
+        }
+    }
+    for (; b < count; b++) vperm_cipher_block(&blocks[b], round_keys, rounds);
+}
+
+VPERM_TARGET void vperm_decipher_blocks(Block* blocks, size_t count, const Block* dec_keys, size_t rounds) {
+    const __m128i inv_shift_rows = _mm_set_epi8(3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13, 0);
+    size_t b = 0;
+    for (; b + VPERM_LANES <= count; b += VPERM_LANES) {
+        __m128i s[VPERM_LANES];
+        __m128i k = _mm_loadu_si128((const __m128i*)&dec_keys[0]);
+        for (size_t j = 0; j < VPERM_LANES; j++) s[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[b + j]), k);
+        for (size_t i = 1; i < rounds; i++) {
+            k = _mm_loadu_si128((const __m128i*)&dec_keys[i]);
+            #pragma GCC unroll 4
+            for (size_t j = 0; j < VPERM_LANES; j++) {
+                s[j] = vperm_sub_bytes(_mm_shuffle_epi8(s[j], inv_shift_rows), VPERM_DEC_IN_LO, VPERM_DEC_OUT_LO);
+                s[j] = _mm_xor_si128(vperm_inv_mix_columns(s[j]), k);
+            }
+        }
+        k = _mm_loadu_si128((const __m128i*)&dec_keys[rounds]);
+        for (size_t j = 0; j < VPERM_LANES; j++) {
+            s[j] = vperm_sub_bytes(_mm_shuffle_epi8(s[j], inv_shift_rows), VPERM_DEC_IN_LO, VPERM_DEC_OUT_LO);
+            _mm_storeu_si128((__m128i*)&blocks[b + j], _mm_xor_si128(s[j], k));
+        }
+    }
+    for (; b < count; b++) vperm_decipher_block(&blocks[b], dec_keys, rounds);
+}
+#endif//__SSE2__
+
+// interchangeable implementations of the block functions, the round keys of
+// every key_expansion are the same and so are the decryption schedules of
+// every inv_key_expansion, which the decipher functions take.
+// cipher_blocks/decipher_blocks run ECB
+// over an array (NULL when the backend has no faster way than block by
+// block), supported is NULL for portable backends
+
+typedef struct {
+    const char* name;
+    void (*key_expansion)(const uint32_t* key, size_t key_len, Block* round_keys, size_t rounds);
+    void (*inv_key_expansion)(const Block* round_keys, size_t rounds, Block* dec_keys);
+    void (*cipher_block)(Block* state, const Block* round_keys, size_t rounds);
+    void (*decipher_block)(Block* state, const Block* dec_keys, size_t rounds);
+    void (*cipher_blocks)(Block* blocks, size_t count, const Block* round_keys, size_t rounds);
+    void (*decipher_blocks)(Block* blocks, size_t count, const Block* dec_keys, size_t rounds);
+    bool (*supported)();
+} AesBackend;
+
+// preferred first for single blocks: AES-NI, then constant time over tables
+static const AesBackend AES_BACKENDS[] = {
+#ifdef __SSE2__
+    { "aesni", aesni_key_expansion, aesni_inv_key_expansion, aesni_cipher_block, aesni_decipher_block, aesni_cipher_blocks, aesni_decipher_blocks, aesni_supported },
+#endif
+#ifdef __SSE2__
+    { "vperm", key_expansion, inv_key_expansion, vperm_cipher_block, vperm_decipher_block, vperm_cipher_blocks, vperm_decipher_blocks, vperm_supported },
+#endif
+    { "ttable", key_expansion, inv_key_expansion, ttable_cipher_block, ttable_decipher_block, ttable_cipher_blocks, ttable_decipher_blocks, NULL },
+#ifdef __SSE2__
+    { "bitsliced", key_expansion, inv_key_expansion, bitsliced_cipher_block, bitsliced_decipher_block, bitsliced_cipher_blocks, bitsliced_decipher_blocks, NULL },
+#endif
+    { "reference", key_expansion, inv_key_expansion, cipher_block, decipher_block, NULL, NULL, NULL },
+};
+#define AES_BACKENDS_COUNT (sizeof(AES_BACKENDS) / sizeof(AES_BACKENDS[0]))
+
+static const AesBackend* AES_REFERENCE = &AES_BACKENDS[AES_BACKENDS_COUNT - 1];
+
+static bool backend_supported(const AesBackend* backend) {
+    return backend->supported == NULL || backend->supported();
+}
+
+// NULL if there is no such backend or the CPU can't run it
+const AesBackend* find_backend(const char* name) {
+    for (size_t i = 0; i < AES_BACKENDS_COUNT; i++) {
+        if (strcmp(AES_BACKENDS[i].name, name) == 0) {
+            return backend_supported(&AES_BACKENDS[i]) ? &AES_BACKENDS[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+const AesBackend* best_backend() {
+    for (size_t i = 0; i < AES_BACKENDS_COUNT; i++) {
+        if (backend_supported(&AES_BACKENDS[i])) return &AES_BACKENDS[i];
+    }
+    return AES_REFERENCE;
+}
+
+// ECB through the backend's array function when it has one
+void backend_cipher_blocks(const AesBackend* backend, Block* blocks, size_t count, const Block* round_keys, size_t rounds) {
+    if (backend->cipher_blocks != NULL) {
+        backend->cipher_blocks(blocks, count, round_keys, rounds);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        backend->cipher_block(&blocks[i], round_keys, rounds);
+    }
+}
+
+// ECB decryption, the same way
+void backend_decipher_blocks(const AesBackend* backend, Block* blocks, size_t count, const Block* dec_keys, size_t rounds) {
+    if (backend->decipher_blocks != NULL) {
+        backend->decipher_blocks(blocks, count, dec_keys, rounds);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        backend->decipher_block(&blocks[i], dec_keys, rounds);
+    }
+}
+
+// the preferred backend among those with an array function, for bulk work
+const AesBackend* bulk_backend() {
+    for (size_t i = 0; i < AES_BACKENDS_COUNT; i++) {
+        if (AES_BACKENDS[i].cipher_blocks != NULL && backend_supported(&AES_BACKENDS[i])) return &AES_BACKENDS[i];
+    }
+    return best_backend();
+}
+
+// Key schedules of the standard key sizes in both directions, sized for
+// AES-256 instead of MAX_AES_ROUNDS
+
+#define AES_KEY_MAX_ROUNDS 14
+#define CACHE_LINE 64
+
+typedef struct {
+    Block enc[AES_KEY_MAX_ROUNDS + 1];
+    Block dec[AES_KEY_MAX_ROUNDS + 1];
+    size_t rounds;
+} AesKeySchedule;
+
+// key_len of 4, 6 or 8 words
+void aes_key_schedule_init(AesKeySchedule* schedule, const AesBackend* backend, const uint32_t* key, size_t key_len) {
+    assert(key_len == 4 || key_len == 6 || key_len == 8);
+    schedule->rounds = key_len + 6;
+    backend->key_expansion(key, key_len, schedule->enc, schedule->rounds);
+    backend->inv_key_expansion(schedule->enc, schedule->rounds, schedule->dec);
+}
+
+// Key schedule cache
+//
+// A fixed number of entries, found by key through a hash table of chained
+// entry indices and evicted least recently used first (a doubly linked list
+// through the entries). An entry is cache line aligned with the key and the
+// links in its first line, so a lookup touches one line per candidate. Not
+// thread safe, one cache per thread.
+
+#define KEY_CACHE_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t key[8];
+    uint32_t key_len;
+    uint32_t hash_next;
+    uint32_t lru_prev; // towards the most recent
+    uint32_t lru_next;
+    _Alignas(CACHE_LINE) AesKeySchedule schedule;
+} KeyCacheEntry;
+
+typedef struct {
+    const AesBackend* backend;
+    KeyCacheEntry* entries;
+    uint32_t* buckets;
+    size_t capacity;
+    size_t used;
+    size_t bucket_mask;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+} KeyCache;
+
+bool key_cache_init(KeyCache* cache, const AesBackend* backend, size_t capacity) {
+    assert(1 <= capacity && capacity < KEY_CACHE_NONE);
+    size_t buckets = 1;
+    while (buckets < 2 * capacity) buckets *= 2;
+    cache->backend = backend;
+    cache->entries = (KeyCacheEntry*)aligned_alloc(CACHE_LINE, capacity * sizeof(KeyCacheEntry));
+    cache->buckets = (uint32_t*)malloc(buckets * sizeof(uint32_t));
+    if (cache->entries == NULL || cache->buckets == NULL) {
+        free(cache->entries);
+        free(cache->buckets);
+        return false;
+    }
+    memset(cache->buckets, 0xFF, buckets * sizeof(uint32_t));
+    cache->capacity = capacity;
+    cache->used = 0;
+    cache->bucket_mask = buckets - 1;
+    cache->lru_head = KEY_CACHE_NONE;
+    cache->lru_tail = KEY_CACHE_NONE;
+    cache->hits = 0;
+    cache->misses = 0;
+    return true;
+}
+
+void key_cache_free(KeyCache* cache) {
+    free(cache->entries);
+    free(cache->buckets);
+}
+
+static size_t key_cache_bucket(const KeyCache* cache, const uint32_t* key, size_t key_len) {
+    uint64_t h = key_len;
+    for (size_t i = 0; i < key_len; i++) {
+        h = (h ^ key[i]) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    return (size_t)h & cache->bucket_mask;
+}
+
+static void key_cache_lru_unlink(KeyCache* cache, uint32_t i) {
+    KeyCacheEntry* entry = &cache->entries[i];
+    if (entry->lru_prev != KEY_CACHE_NONE) {
+        cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != KEY_CACHE_NONE) {
+        cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+}
+
+static void key_cache_lru_push(KeyCache* cache, uint32_t i) {
+    KeyCacheEntry* entry = &cache->entries[i];
+    entry->lru_prev = KEY_CACHE_NONE;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != KEY_CACHE_NONE) {
+        cache->entries[cache->lru_head].lru_prev = i;
+    } else {
+        cache->lru_tail = i;
+    }
+    cache->lru_head = i;
+}
+
+// takes the least recently used entry out of its bucket
+static uint32_t key_cache_evict(KeyCache* cache) {
+    uint32_t i = cache->lru_tail;
+    KeyCacheEntry* entry = &cache->entries[i];
+    key_cache_lru_unlink(cache, i);
+    uint32_t* link = &cache->buckets[key_cache_bucket(cache, entry->key, entry->key_len)];
+    while (*link != i) link = &cache->entries[*link].hash_next;
+    *link = entry->hash_next;
+    return i;
+}
+
+// the schedule of a key of 4, 6 or 8 words, expanded on a miss. It stays
+// valid until it is evicted, after capacity lookups of other keys at worst
+const AesKeySchedule* key_cache_get(KeyCache* cache, const uint32_t* key, size_t key_len) {
+    size_t bucket = key_cache_bucket(cache, key, key_len);
+    for (uint32_t i = cache->buckets[bucket]; i != KEY_CACHE_NONE; i = cache->entries[i].hash_next) {
+        KeyCacheEntry* entry = &cache->entries[i];
+        if (entry->key_len == key_len && memcmp(entry->key, key, key_len * sizeof(uint32_t)) == 0) {
+            cache->hits += 1;
+            if (cache->lru_head != i) {
+                key_cache_lru_unlink(cache, i);
+                key_cache_lru_push(cache, i);
+            }
+            return &entry->schedule;
+        }
+    }
+    cache->misses += 1;
+    uint32_t i = cache->used < cache->capacity ? (uint32_t)cache->used++ : key_cache_evict(cache);
+    KeyCacheEntry* entry = &cache->entries[i];
+    memcpy(entry->key, key, key_len * sizeof(uint32_t));
+    entry->key_len = (uint32_t)key_len;
+    aes_key_schedule_init(&entry->schedule, cache->backend, key, key_len);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+    key_cache_lru_push(cache, i);
+    return &entry->schedule;
+}
+
+double key_cache_hit_rate(const KeyCache* cache) {
+    uint64_t lookups = cache->hits + cache->misses;
+    return lookups == 0 ? 0. : (double)cache->hits / (double)lookups;
+}
+
+// Batch key expansion
+//
+// Up to KEY_BATCH_LANES independent keys of one size expanded side by side,
+// four lanes to an SSE register. The schedules are a structure of arrays:
+// word i of every lane is w[i][lane], in memory order like the words of a
+// Block, so a step of the schedule is a vector operation on a row, and round
+// key r of a lane is rows 4r to 4r + 3 of its column.
+
+#define KEY_BATCH_LANES 16
+#define KEY_BATCH_WORDS (4 * (MAX_AES_ROUNDS + 1))
+
+typedef struct {
+    _Alignas(CACHE_LINE) uint32_t w[KEY_BATCH_WORDS][KEY_BATCH_LANES];
+} KeyBatch;
+
+#ifdef __SSE2__
+typedef __m128i (*KeyBatchSubFn)(__m128i x);
+
+#define KEY_BATCH_VECTORS (KEY_BATCH_LANES / 4)
+
+// the schedule words of four lanes per step, sub is SubBytes on 16 bytes.
+// RotWord is a rotation of the words, the first byte being the low one. The
+// last words stay in registers, reloading them would put a store forwarding
+// on the dependency chain
+static ALWAYS_INLINE void key_batch_words(KeyBatch* batch, size_t key_len, size_t rounds, KeyBatchSubFn sub) {
+    __m128i t[KEY_BATCH_VECTORS];
+    for (size_t v = 0; v < KEY_BATCH_VECTORS; v++) t[v] = _mm_load_si128((const __m128i*)&batch->w[key_len - 1][4 * v]);
+    // i = key * key_len + j
+    size_t key = 1;
+    size_t j = 0;
+    for (size_t i = key_len; i < 4 * (rounds + 1); i++) {
+        if (j == 0) {
+            __m128i rc = _mm_set1_epi32((int)(rcon[key - 1] >> 24));
+            #pragma GCC unroll 4
+            for (size_t v = 0; v < KEY_BATCH_VECTORS; v++) {
+                __m128i s = sub(t[v]);
+                t[v] = _mm_xor_si128(_mm_or_si128(_mm_srli_epi32(s, 8), _mm_slli_epi32(s, 24)), rc);
+            }
+        } else if (key_len > 6 && j == 4) {
+            #pragma GCC unroll 4
+            for (size_t v = 0; v < KEY_BATCH_VECTORS; v++) t[v] = sub(t[v]);
+        }
+        #pragma GCC unroll 4
+        for (size_t v = 0; v < KEY_BATCH_VECTORS; v++) {
+            t[v] = _mm_xor_si128(t[v], _mm_load_si128((const __m128i*)&batch->w[i - key_len][4 * v]));
+            _mm_store_si128((__m128i*)&batch->w[i][4 * v], t[v]);
+        }
+        if (++j == key_len) {
+            j = 0;
+            key++;
+        }
+    }
+}
+
+// aesenclast with a zero key shifts the rows after SubBytes, so they are
+// shifted back beforehand
+AESNI_TARGET static ALWAYS_INLINE __m128i aesni_sub_bytes(__m128i x) {
+    x = _mm_shuffle_epi8(x, _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3));
+    return _mm_aesenclast_si128(x, _mm_setzero_si128());
+}
+
+AESNI_TARGET static void aesni_key_batch_words(KeyBatch* batch, size_t key_len, size_t rounds) {
+    key_batch_words(batch, key_len, rounds, aesni_sub_bytes);
+}
+
+VPERM_TARGET static ALWAYS_INLINE __m128i vperm_sub_word_bytes(__m128i x) {
+    return vperm_sub_bytes(x, VPERM_ENC_IN_LO, VPERM_ENC_OUT_LO);
+}
+
+VPERM_TARGET static void vperm_key_batch_words(KeyBatch* batch, size_t key_len, size_t rounds) {
+    key_batch_words(batch, key_len, rounds, vperm_sub_word_bytes);
+}
+#endif//__SSE2__
+
+// the schedules of count keys, keys[lane * key_len + i] being word i of a
+// key as key_expansion takes it. Lanes from count on are expanded from zero
+// keys. Goes through AES-NI or vperm when the CPU has them
+void key_expansion_batch(const uint32_t* keys, size_t count, size_t key_len, size_t rounds, KeyBatch* batch) {
+    assert(count <= KEY_BATCH_LANES && rounds <= MAX_AES_ROUNDS && 1 <= key_len && key_len <= 4 * (rounds + 1));
+    for (size_t i = 0; i < key_len; i++) {
+        for (size_t lane = 0; lane < KEY_BATCH_LANES; lane++) {
+            batch->w[i][lane] = lane < count ? u32_swap_bytes(keys[lane * key_len + i]) : 0;
+        }
+    }
+#ifdef __SSE2__
+    if (aesni_supported()) {
+        aesni_key_batch_words(batch, key_len, rounds);
+        return;
+    }
+    if (vperm_supported()) {
+        vperm_key_batch_words(batch, key_len, rounds);
+        return;
+    }
+#endif
+    for (size_t i = key_len; i < 4 * (rounds + 1); i++) {
+        for (size_t lane = 0; lane < KEY_BATCH_LANES; lane++) {
+            uint32_t t = u32_swap_bytes(batch->w[i - 1][lane]);
+            if (i % key_len == 0) {
+                t = sub_word(rot_word(t)) ^ rcon[i / key_len - 1];
+            } else if (key_len > 6 && i % key_len == 4) {
+                t = sub_word(t);
+            }
+            batch->w[i][lane] = u32_swap_bytes(t) ^ batch->w[i - key_len][lane];
+        }
+    }
+}
+
+// round keys 0 to rounds of lanes 0 to count - 1 as key_expansion writes
+// them, four lanes at a time by a 4x4 transpose of the words
+void key_batch_unpack(const KeyBatch* batch, size_t count, size_t rounds, Block (*round_keys)[MAX_AES_ROUNDS+1]) {
+    assert(count <= KEY_BATCH_LANES && rounds <= MAX_AES_ROUNDS);
+    size_t lane = 0;
+#ifdef __SSE2__
+    for (; lane + 4 <= count; lane += 4) {
+        for (size_t r = 0; r <= rounds; r++) {
+            __m128i w0 = _mm_load_si128((const __m128i*)&batch->w[4 * r][lane]);
+            __m128i w1 = _mm_load_si128((const __m128i*)&batch->w[4 * r + 1][lane]);
+            __m128i w2 = _mm_load_si128((const __m128i*)&batch->w[4 * r + 2][lane]);
+            __m128i w3 = _mm_load_si128((const __m128i*)&batch->w[4 * r + 3][lane]);
+            __m128i lo01 = _mm_unpacklo_epi32(w0, w1);
+            __m128i hi01 = _mm_unpackhi_epi32(w0, w1);
+            __m128i lo23 = _mm_unpacklo_epi32(w2, w3);
+            __m128i hi23 = _mm_unpackhi_epi32(w2, w3);
+            _mm_storeu_si128((__m128i*)&round_keys[lane][r], _mm_unpacklo_epi64(lo01, lo23));
+            _mm_storeu_si128((__m128i*)&round_keys[lane + 1][r], _mm_unpackhi_epi64(lo01, lo23));
+            _mm_storeu_si128((__m128i*)&round_keys[lane + 2][r], _mm_unpacklo_epi64(hi01, hi23));
+            _mm_storeu_si128((__m128i*)&round_keys[lane + 3][r], _mm_unpackhi_epi64(hi01, hi23));
+        }
+    }
+#endif
+    for (; lane < count; lane++) {
+        for (size_t i = 0; i < 4 * (rounds + 1); i++) {
+            round_keys[lane][i / 4].w[i % 4] = batch->w[i][lane];
+        }
+    }
+}
+
+// fork-join worker pool, the calling thread runs worker 0
+
+#define MAX_WORKERS 64
+// smaller buffers aren't worth a thread
+#define MIN_WORKER_LEN (1<<16)
+
+typedef void (*WorkerFn)(void* ctx, size_t worker, size_t workers);
+
+typedef struct {
+    WorkerFn fn;
+    void* ctx;
+    size_t worker;
+    size_t workers;
+} WorkerArgs;
+
+static void* worker_main(void* arg) {
+    WorkerArgs* args = (WorkerArgs*)arg;
+    args->fn(args->ctx, args->worker, args->workers);
+    return NULL;
+}
+
+static void run_workers(size_t workers, WorkerFn fn, void* ctx) {
+    assert(1 <= workers && workers <= MAX_WORKERS);
+    pthread_t threads[MAX_WORKERS];
+    WorkerArgs args[MAX_WORKERS];
+    bool started[MAX_WORKERS] = {0};
+    for (size_t i = 1; i < workers; i++) {
+        args[i] = (WorkerArgs){ fn, ctx, i, workers };
+        started[i] = pthread_create(&threads[i], NULL, worker_main, &args[i]) == 0;
+    }
+    fn(ctx, 0, workers);
+    for (size_t i = 1; i < workers; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            // out of threads, do its share here
+            fn(ctx, i, workers);
+        }
+    }
+}
+
+// [*begin, *end) is the part-th of parts equal slices of [0, n)
+static void split_range(size_t n, size_t part, size_t parts, size_t* begin, size_t* end) {
+    *begin = n * part / parts;
+    *end = n * (part + 1) / parts;
+}
+
+// dst ^= src
+static void xor_bytes(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, s));
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, s));
+    }
+#endif
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// ECB mode over the array functions, split between up to `threads` workers
+
+typedef struct {
+    const AesBackend* backend;
+    const Block* keys;
+    size_t rounds;
+    Block* blocks;
+    size_t count;
+    bool decrypt;
+} EcbJob;
+
+static void ecb_worker(void* ctx, size_t worker, size_t workers) {
+    EcbJob* job = (EcbJob*)ctx;
+    size_t begin, end;
+    split_range(job->count, worker, workers, &begin, &end);
+    if (job->decrypt) {
+        backend_decipher_blocks(job->backend, job->blocks + begin, end - begin, job->keys, job->rounds);
+    } else {
+        backend_cipher_blocks(job->backend, job->blocks + begin, end - begin, job->keys, job->rounds);
+    }
+}
+
+static size_t block_workers(size_t count, size_t threads) {
+    size_t workers = count * sizeof(Block) / MIN_WORKER_LEN + 1;
+    return workers > threads ? threads : workers;
+}
+
+void aes_ecb_encrypt(const AesBackend* backend, const Block* round_keys, size_t rounds, Block* blocks, size_t count, size_t threads) {
+    EcbJob job = { backend, round_keys, rounds, blocks, count, false };
+    run_workers(block_workers(count, threads), ecb_worker, &job);
+}
+
+// dec_keys from inv_key_expansion
+void aes_ecb_decrypt(const AesBackend* backend, const Block* dec_keys, size_t rounds, Block* blocks, size_t count, size_t threads) {
+    EcbJob job = { backend, dec_keys, rounds, blocks, count, true };
+    run_workers(block_workers(count, threads), ecb_worker, &job);
+}
+
+// CTR mode
+//
+// Block i of the keystream is the encrypted counter iv + i, the counter being
+// the whole block as a big-endian 128-bit number (SP 800-38A). Any byte of
+// the keystream can be computed on its own, so buffers are split between
+// workers by range and a call can start at any byte offset of the stream.
+// Counters are encrypted CTR_BATCH at a time to feed the array functions.
+
+#define CTR_BATCH 64
+
+typedef struct {
+    const AesBackend* backend;
+    const Block* round_keys;
+    size_t rounds;
+    uint64_t iv_hi;
+    uint64_t iv_lo;
+} AesCtr;
+
+void aes_ctr_init(AesCtr* ctr, const AesBackend* backend, const Block* round_keys, size_t rounds, const Block* iv) {
+    uint64_t words[2];
+    memcpy(words, iv, sizeof(words));
+    ctr->backend = backend;
+    ctr->round_keys = round_keys;
+    ctr->rounds = rounds;
+    ctr->iv_hi = __builtin_bswap64(words[0]);
+    ctr->iv_lo = __builtin_bswap64(words[1]);
+}
+
+// count counter blocks from block index `index` on
+static void aes_ctr_counters(const AesCtr* ctr, uint64_t index, Block* blocks, size_t count) {
+    uint64_t lo = ctr->iv_lo + index;
+    uint64_t hi = ctr->iv_hi + (lo < ctr->iv_lo);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t words[2] = { __builtin_bswap64(hi), __builtin_bswap64(lo) };
+        memcpy(&blocks[i], words, sizeof(Block));
+        lo += 1;
+        hi += lo == 0;
+    }
+}
+
+// xors the keystream from byte `offset` on into data
+void aes_ctr_apply(const AesCtr* ctr, uint64_t offset, uint8_t* data, size_t len) {
+    Block keystream[CTR_BATCH];
+    uint64_t index = offset / sizeof(Block);
+    size_t skip = (size_t)(offset % sizeof(Block));
+    while (len > 0) {
+        size_t count = (skip + len + sizeof(Block) - 1) / sizeof(Block);
+        if (count > CTR_BATCH) count = CTR_BATCH;
+        aes_ctr_counters(ctr, index, keystream, count);
+        backend_cipher_blocks(ctr->backend, keystream, count, ctr->round_keys, ctr->rounds);
+        size_t n = count * sizeof(Block) - skip;
+        if (n > len) n = len;
+        xor_bytes(data, (const uint8_t*)keystream + skip, n);
+        data += n;
+        len -= n;
+        index += count;
+        skip = 0;
+    }
+}
+
+typedef struct {
+    const AesCtr* ctr;
+    uint64_t offset;
+    uint8_t* data;
+    size_t len;
+} CtrJob;
+
+// the slices start on block boundaries so no block is computed twice
+static void ctr_worker(void* ctx, size_t worker, size_t workers) {
+    CtrJob* job = (CtrJob*)ctx;
+    size_t head = (size_t)((sizeof(Block) - job->offset % sizeof(Block)) % sizeof(Block));
+    if (head > job->len) head = job->len;
+    size_t blocks = (job->len - head) / sizeof(Block);
+    size_t begin, end;
+    split_range(blocks, worker, workers, &begin, &end);
+    begin = worker == 0 ? 0 : head + begin * sizeof(Block);
+    end = worker + 1 == workers ? job->len : head + end * sizeof(Block);
+    aes_ctr_apply(job->ctr, job->offset + begin, job->data + begin, end - begin);
+}
+
+// aes_ctr_apply split between up to `threads` workers
+void aes_ctr_apply_parallel(const AesCtr* ctr, uint64_t offset, uint8_t* data, size_t len, size_t threads) {
+    size_t workers = len / MIN_WORKER_LEN + 1;
+    if (workers > threads) workers = threads;
+    CtrJob job = { ctr, offset, data, len };
+    run_workers(workers, ctr_worker, &job);
+}
+
+// CBC mode
+//
+// Encryption chains every block into the next, so it runs block by block.
+// Block i decrypts from ciphertext blocks i and i - 1 alone, so decryption
+// goes through the array functions CBC_BATCH blocks at a time. iv is left at
+// the last ciphertext block, so consecutive calls continue one message.
+
+#define CBC_BATCH 64
+
+void aes_cbc_encrypt(const AesBackend* backend, const Block* round_keys, size_t rounds, Block* iv, Block* blocks, size_t count) {
+    Block chain = *iv;
+    for (size_t i = 0; i < count; i++) {
+        add_round_key(&blocks[i], &chain);
+        backend->cipher_block(&blocks[i], round_keys, rounds);
+        chain = blocks[i];
+    }
+    *iv = chain;
+}
+
+// dec_keys from inv_key_expansion
+void aes_cbc_decrypt(const AesBackend* backend, const Block* dec_keys, size_t rounds, Block* iv, Block* blocks, size_t count) {
+    Block cipher[CBC_BATCH];
+    for (size_t done = 0; done < count; done += CBC_BATCH) {
+        size_t n = count - done < CBC_BATCH ? count - done : CBC_BATCH;
+        Block* batch = blocks + done;
+        memcpy(cipher, batch, n * sizeof(Block));
+        backend_decipher_blocks(backend, batch, n, dec_keys, rounds);
+        add_round_key(&batch[0], iv);
+        for (size_t i = 1; i < n; i++) add_round_key(&batch[i], &cipher[i - 1]);
+        *iv = cipher[n - 1];
+    }
+}
+
+typedef struct {
+    const AesBackend* backend;
+    const Block* dec_keys;
+    size_t rounds;
+    Block* blocks;
+    size_t count;
+    Block chain[MAX_WORKERS]; // the ciphertext block before each slice
+} CbcJob;
+
+static void cbc_worker(void* ctx, size_t worker, size_t workers) {
+    CbcJob* job = (CbcJob*)ctx;
+    size_t begin, end;
+    split_range(job->count, worker, workers, &begin, &end);
+    aes_cbc_decrypt(job->backend, job->dec_keys, job->rounds, &job->chain[worker], job->blocks + begin, end - begin);
+}
+
+// aes_cbc_decrypt split between up to `threads` workers, the blocks before
+// the slices are saved first as the decryption is in place
+void aes_cbc_decrypt_parallel(const AesBackend* backend, const Block* dec_keys, size_t rounds, Block* iv, Block* blocks, size_t count, size_t threads) {
+    if (count == 0) return;
+    size_t workers = block_workers(count, threads);
+    CbcJob job = { backend, dec_keys, rounds, blocks, count, {{{0}}} };
+    for (size_t w = 0; w < workers; w++) {
+        size_t begin, end;
+        split_range(count, w, workers, &begin, &end);
+        job.chain[w] = begin == 0 ? *iv : blocks[begin - 1];
+    }
+    Block last = blocks[count - 1];
+    run_workers(workers, cbc_worker, &job);
+    *iv = last;
+}
+
+// GHASH
+//
+// Multiplication by H in GF(2^128) over 16-byte blocks, the authenticator of
+// GCM. With PCLMULQDQ the blocks are byte-reversed so the carry-less product
+// can be shifted into GCM's reflected bit order, and GHASH_AGGREGATE blocks
+// are multiplied by H^4..H^1 and summed before a single reduction. Without
+// it Shoup's 4-bit tables of multiples of H are used.
+
+#define GHASH_AGGREGATE 4
+
+typedef struct {
+    bool clmul;
+#ifdef __SSE2__
+    __m128i h_pow[GHASH_AGGREGATE]; // H^(i+1), byte-reversed
+#endif
+    uint64_t hh[16]; // i H for 4-bit i, high and low halves
+    uint64_t hl[16];
+} GhashKey;
+
+static uint64_t load_be64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap64(v);
+}
+
+static void store_be64(uint8_t* p, uint64_t v) {
+    v = __builtin_bswap64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// reductions of the 4 bits shifted out at the bottom
+static const uint64_t GHASH_LAST4[16] = {
+    0x0000, 0x1C20, 0x3840, 0x2460, 0x7080, 0x6CA0, 0x48C0, 0x54E0,
+    0xE100, 0xFD20, 0xD940, 0xC560, 0x9180, 0x8DA0, 0xA9C0, 0xB5E0,
+};
+
+static void ghash_init_4bit(GhashKey* key, const uint8_t* h) {
+    uint64_t vh = load_be64(h);
+    uint64_t vl = load_be64(h + 8);
+    key->hh[0] = 0;
+    key->hl[0] = 0;
+    key->hh[8] = vh;
+    key->hl[8] = vl;
+    // 4, 2, 1 are H times x, x^2, x^3 in the reflected order
+    for (size_t i = 4; i > 0; i >>= 1) {
+        uint64_t t = (vl & 1) * 0xE1000000;
+        vl = vh << 63 | vl >> 1;
+        vh = vh >> 1 ^ t << 32;
+        key->hh[i] = vh;
+        key->hl[i] = vl;
+    }
+    for (size_t i = 2; i <= 8; i *= 2) {
+        for (size_t j = 1; j < i; j++) {
+            key->hh[i + j] = key->hh[i] ^ key->hh[j];
+            key->hl[i + j] = key->hl[i] ^ key->hl[j];
+        }
+    }
+}
+
+// x = x H, a nibble at a time from the last byte on
+static void ghash_mult_4bit(const GhashKey* key, uint8_t* x) {
+    size_t lo = x[15] & 0xF;
+    uint64_t zh = key->hh[lo];
+    uint64_t zl = key->hl[lo];
+    for (size_t i = 16; i-- > 0;) {
+        lo = x[i] & 0xF;
+        size_t hi = x[i] >> 4;
+        if (i != 15) {
+            size_t rem = zl & 0xF;
+            zl = zh << 60 | zl >> 4;
+            zh = zh >> 4 ^ GHASH_LAST4[rem] << 48;
+            zh ^= key->hh[lo];
+            zl ^= key->hl[lo];
+        }
+        size_t rem = zl & 0xF;
+        zl = zh << 60 | zl >> 4;
+        zh = zh >> 4 ^ GHASH_LAST4[rem] << 48;
+        zh ^= key->hh[hi];
+        zl ^= key->hl[hi];
+    }
+    store_be64(x, zh);
+    store_be64(x + 8, zl);
+}
+
+static void ghash_update_4bit(const GhashKey* key, uint8_t* y, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i += 16) {
+        size_t n = len - i < 16 ? len - i : 16;
+        for (size_t j = 0; j < n; j++) y[j] ^= data[i + j];
+        ghash_mult_4bit(key, y);
+    }
+}
+
+#ifdef __SSE2__
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#define GHASH_REVERSE _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+
+static bool clmul_supported() {
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+// 256-bit carry-less product a b into *lo, *hi (Karatsuba-free, 4 products)
+CLMUL_TARGET static void clmul_wide(__m128i a, __m128i b, __m128i* lo, __m128i* hi) {
+    __m128i l = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i m = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i h = _mm_clmulepi64_si128(a, b, 0x11);
+    *lo = _mm_xor_si128(l, _mm_slli_si128(m, 8));
+    *hi = _mm_xor_si128(h, _mm_srli_si128(m, 8));
+}
+
+// hi:lo shifted up a bit (the reflected order) and reduced modulo
+// x^128 + x^7 + x^2 + x + 1
+CLMUL_TARGET static __m128i clmul_reduce(__m128i lo, __m128i hi) {
+    __m128i carry_lo = _mm_srli_epi32(lo, 31);
+    __m128i carry_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i across = _mm_srli_si128(carry_lo, 12);
+    lo = _mm_or_si128(lo, _mm_slli_si128(carry_lo, 4));
+    hi = _mm_or_si128(_mm_or_si128(hi, _mm_slli_si128(carry_hi, 4)), across);
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    __m128i rest = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    b = _mm_xor_si128(b, rest);
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, b));
+}
+
+CLMUL_TARGET static __m128i clmul_mult(__m128i a, __m128i b) {
+    __m128i lo, hi;
+    clmul_wide(a, b, &lo, &hi);
+    return clmul_reduce(lo, hi);
+}
+
+CLMUL_TARGET static void ghash_init_clmul(GhashKey* key, const uint8_t* h) {
+    __m128i h1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)h), GHASH_REVERSE);
+    key->h_pow[0] = h1;
+    for (size_t i = 1; i < GHASH_AGGREGATE; i++) {
+        key->h_pow[i] = clmul_mult(key->h_pow[i - 1], h1);
+    }
+}
+
+CLMUL_TARGET static void ghash_update_clmul(const GhashKey* key, uint8_t* y, const uint8_t* data, size_t len) {
+    const __m128i reverse = GHASH_REVERSE;
+    __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)y), reverse);
+    size_t i = 0;
+    // (x + d0) H^4 + d1 H^3 + d2 H^2 + d3 H, one reduction
+    for (; i + 16 * GHASH_AGGREGATE <= len; i += 16 * GHASH_AGGREGATE) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for (size_t j = 0; j < GHASH_AGGREGATE; j++) {
+            __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i + 16 * j)), reverse);
+            if (j == 0) d = _mm_xor_si128(d, x);
+            __m128i l, h;
+            clmul_wide(d, key->h_pow[GHASH_AGGREGATE - 1 - j], &l, &h);
+            lo = _mm_xor_si128(lo, l);
+            hi = _mm_xor_si128(hi, h);
+        }
+        x = clmul_reduce(lo, hi);
+    }
+    for (; i < len; i += 16) {
+        uint8_t block[16] = {0};
+        memcpy(block, data + i, len - i < 16 ? len - i : 16);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)block), reverse);
+        x = clmul_mult(_mm_xor_si128(x, d), key->h_pow[0]);
+    }
+    _mm_storeu_si128((__m128i*)y, _mm_shuffle_epi8(x, reverse));
+}
+#endif//__SSE2__
+
+// clmul picks PCLMULQDQ when the CPU has it
+void ghash_init(GhashKey* key, const uint8_t* h, bool clmul) {
+    memset(key, 0, sizeof(GhashKey));
+#ifdef __SSE2__
+    key->clmul = clmul && clmul_supported();
+    if (key->clmul) {
+        ghash_init_clmul(key, h);
+        return;
+    }
+#endif
+    ghash_init_4bit(key, h);
+}
+
+// y = (y + data) H block by block, a short last block padded with zeros
+void ghash_update(const GhashKey* key, uint8_t* y, const uint8_t* data, size_t len) {
+#ifdef __SSE2__
+    if (key->clmul) {
+        ghash_update_clmul(key, y, data, len);
+        return;
+    }
+#endif
+    ghash_update_4bit(key, y, data, len);
+}
+
+// GCM (SP 800-38D)
+//
+// CTR with a 32-bit counter in the last word of the block, authenticated by
+// GHASH over the AAD, the ciphertext and their bit lengths. The data is
+// processed GCM_BATCH blocks at a time: the keystream of a batch is computed
+// and applied and the batch is hashed while it is still in L1, so every byte
+// is read and written once.
+
+#define GCM_BATCH 64
+#define GCM_TAG_LEN 16
+// counter block 1 is the tag's, the data gets the other 2^32 - 2
+#define GCM_MAX_LEN ((((uint64_t)1 << 32) - 2) * 16)
+
+typedef struct {
+    const AesBackend* backend;
+    const Block* round_keys;
+    size_t rounds;
+    GhashKey ghash;
+} AesGcm;
+
+void aes_gcm_init(AesGcm* gcm, const AesBackend* backend, const Block* round_keys, size_t rounds, bool clmul) {
+    gcm->backend = backend;
+    gcm->round_keys = round_keys;
+    gcm->rounds = rounds;
+    Block h = {0};
+    backend->cipher_block(&h, round_keys, rounds);
+    ghash_init(&gcm->ghash, (const uint8_t*)&h, clmul);
+}
+
+static void gcm_j0(const AesGcm* gcm, const uint8_t* iv, size_t iv_len, uint8_t* j0) {
+    memset(j0, 0, 16);
+    if (iv_len == 12) {
+        memcpy(j0, iv, 12);
+        j0[15] = 1;
+        return;
+    }
+    uint8_t lens[16] = {0};
+    store_be64(lens + 8, (uint64_t)iv_len * 8);
+    ghash_update(&gcm->ghash, j0, iv, iv_len);
+    ghash_update(&gcm->ghash, j0, lens, 16);
+}
+
+// counter blocks j0 + first .. j0 + first + count - 1 (mod 2^32 in the last word)
+static void gcm_counters(const uint8_t* j0, uint32_t first, Block* blocks, size_t count) {
+    uint32_t base;
+    memcpy(&base, j0 + 12, 4);
+    base = __builtin_bswap32(base) + first;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t word = __builtin_bswap32(base + (uint32_t)i);
+        memcpy(&blocks[i], j0, 12);
+        memcpy((uint8_t*)&blocks[i] + 12, &word, 4);
+    }
+}
+
+// a message in pieces: aes_gcm_start, aes_gcm_update on consecutive parts of
+// the data (all but the last a multiple of 16 bytes), aes_gcm_finish
+typedef struct {
+    const AesGcm* gcm;
+    uint8_t j0[16];
+    uint8_t y[16];
+    uint32_t counter;
+    uint64_t aad_len;
+    uint64_t len;
+} AesGcmStream;
+
+void aes_gcm_start(AesGcmStream* stream, const AesGcm* gcm, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len) {
+    stream->gcm = gcm;
+    memset(stream->y, 0, sizeof(stream->y));
+    stream->counter = 1;
+    stream->aad_len = aad_len;
+    stream->len = 0;
+    gcm_j0(gcm, iv, iv_len, stream->j0);
+    ghash_update(&gcm->ghash, stream->y, aad, aad_len);
+}
+
+// en/decrypts data in place and hashes the ciphertext
+void aes_gcm_update(AesGcmStream* stream, uint8_t* data, size_t len, bool encrypt) {
+    const AesGcm* gcm = stream->gcm;
+    assert(stream->len % sizeof(Block) == 0);
+    assert(len <= GCM_MAX_LEN - stream->len);
+    Block keystream[GCM_BATCH];
+    for (size_t done = 0; done < len; done += sizeof(keystream)) {
+        size_t n = len - done < sizeof(keystream) ? len - done : sizeof(keystream);
+        size_t count = (n + sizeof(Block) - 1) / sizeof(Block);
+        gcm_counters(stream->j0, stream->counter, keystream, count);
+        backend_cipher_blocks(gcm->backend, keystream, count, gcm->round_keys, gcm->rounds);
+        if (!encrypt) ghash_update(&gcm->ghash, stream->y, data + done, n);
+        xor_bytes(data + done, (const uint8_t*)keystream, n);
+        if (encrypt) ghash_update(&gcm->ghash, stream->y, data + done, n);
+        stream->counter += (uint32_t)count;
+    }
+    stream->len += len;
+}
+
+// tag gets GCM_TAG_LEN bytes
+void aes_gcm_finish(AesGcmStream* stream, uint8_t* tag) {
+    const AesGcm* gcm = stream->gcm;
+    uint8_t lens[16];
+    store_be64(lens, stream->aad_len * 8);
+    store_be64(lens + 8, stream->len * 8);
+    ghash_update(&gcm->ghash, stream->y, lens, 16);
+    Block s;
+    memcpy(&s, stream->j0, sizeof(Block));
+    gcm->backend->cipher_block(&s, gcm->round_keys, gcm->rounds);
+    memcpy(tag, &s, GCM_TAG_LEN);
+    xor_bytes(tag, stream->y, GCM_TAG_LEN);
+}
+
+bool aes_gcm_tags_equal(const uint8_t* a, const uint8_t* b) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < GCM_TAG_LEN; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+// encrypts data in place, tag gets GCM_TAG_LEN bytes
+void aes_gcm_encrypt(const AesGcm* gcm, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len,
+                     uint8_t* data, size_t len, uint8_t* tag) {
+    AesGcmStream stream;
+    aes_gcm_start(&stream, gcm, iv, iv_len, aad, aad_len);
+    aes_gcm_update(&stream, data, len, true);
+    aes_gcm_finish(&stream, tag);
+}
+
+// decrypts data in place and checks the tag in constant time, on a
+// mismatch the data is wiped and false returned
+bool aes_gcm_decrypt(const AesGcm* gcm, const uint8_t* iv, size_t iv_len, const uint8_t* aad, size_t aad_len,
+                     uint8_t* data, size_t len, const uint8_t* tag) {
+    AesGcmStream stream;
+    uint8_t expected[GCM_TAG_LEN];
+    aes_gcm_start(&stream, gcm, iv, iv_len, aad, aad_len);
+    aes_gcm_update(&stream, data, len, false);
+    aes_gcm_finish(&stream, expected);
+    if (!aes_gcm_tags_equal(expected, tag)) {
+        memset(data, 0, len);
+        return false;
+    }
+    return true;
+}
+
+// FIPS-197 appendix C: plaintext 00112233..FF under key 000102..
+#define TEST_VECTORS_COUNT 3
+static const size_t TEST_KEY_LENS[TEST_VECTORS_COUNT] = { 4, 6, 8 };
+static const uint32_t TEST_OUTPUTS[TEST_VECTORS_COUNT][4] = {
+    { 0x69C4E0D8, 0x6A7B0430, 0xD8CDB780, 0x70B4C55A },
+    { 0xDDA97CA4, 0x864CDFE0, 0x6EAF70A0, 0xEC0D7191 },
+    { 0x8EA2B7CA, 0x516745BF, 0xEAFC4990, 0x4B496089 },
+};
+
+static bool blocks_equal(const Block* a, const Block* b) {
+    return memcmp(a, b, sizeof(Block)) == 0;
+}
+
+// runs the vectors through a backend, false on any mismatch
+static bool show_test_vectors(const AesBackend* backend) {
+    // KEYS
+    //const uint32_t example_key[8] = {
+    //    0x603DEB10,
+    //    0x15CA71BE,
+    //    0x2B73AEF0,
+    //    0x857D7781,
+    //    0x1F352C07,
+    //    0x3B6108D7,
+    //    0x2D9810A3,
+    //    0x0914DFF4,
+    //};
+    //const uint32_t example_key[4] = {
+    //    0x00010203,
+    //    0x04050607,
+    //    0x08090a0b,
+    //    0x0c0d0e0f,
+    //};
+    //const uint32_t example_key[4] = {
+    //    0x2B7E1516,
+    //    0x28AED2A6,
+    //    0xABF71588,
+    //    0x09CF4F3C,
+    //};
+    const uint32_t example_key[8] = {
+        0x00010203,
+        0x04050607,
+        0x08090A0B,
+        0x0C0D0E0F,
+        0x10111213,
+        0x14151617,
+        0x18191A1B,
+        0x1C1D1E1F,
+    };
+
+    // INPUTS
+
+    //const uint32_t example_input[4] = {
+    //    0x3243F6A8,
+    //    0x885A308D,
+    //    0x313198A2,
+    //    0xE0370734,
+    //};
+    const uint32_t example_input[4] = {
+        0x00112233,
+        0x44556677,
+        0x8899AABB,
+        0xCCDDEEFF,
+    };
+
+    bool ok = true;
+    Block round_keys[MAX_AES_ROUNDS+1];
+    Block dec_keys[MAX_AES_ROUNDS+1];
+    for (size_t v = 0; v < TEST_VECTORS_COUNT; v++) {
+        size_t key_len = TEST_KEY_LENS[v];
+        size_t rounds = key_len + 6;
+        backend->key_expansion(example_key, key_len, round_keys, rounds);
+        //for (size_t i = 0; i <= rounds; i++) {
+        //    display_block(&round_keys[i]);
+        //}
+
+        Block initial = block_from_words_ne(example_input);
+        Block expected = block_from_words_ne(TEST_OUTPUTS[v]);
+        Block state = initial;
+        printf("%s AES-%zu\n", backend->name, key_len * 32);
+        printf("Initial: ");
+        display_block(&state);
+
+        backend->cipher_block(&state, round_keys, rounds);
+        bool encrypted = blocks_equal(&state, &expected);
+        printf("Encrypted: ");
+        display_block(&state);
+
+        backend->inv_key_expansion(round_keys, rounds, dec_keys);
+        backend->decipher_block(&state, dec_keys, rounds);
+        bool decrypted = blocks_equal(&state, &initial);
+        printf("Decrypted: ");
+        display_block(&state);
+        printf("%s\n\n", encrypted && decrypted ? "OK" : "MISMATCH");
+        ok = ok && encrypted && decrypted;
+    }
+    return ok;
+}
+
+#define RANDOM_VECTORS_COUNT 64
+#define RANDOM_VECTORS_MAX_ROUNDS 16
+#define RANDOM_VECTORS_BLOCKS 19
+
+static void random_block(Block* block, uint32_t* random_state) {
+    for (size_t i = 0; i < 4; i++) block->w[i] = xorshift_next(random_state);
+}
+
+// compares round keys, ciphertexts and decryptions of a backend with the
+// reference on random keys and blocks for every key size and round count
+static bool check_random_vectors(const AesBackend* backend) {
+    uint32_t random_state = 42;
+    Block keys[MAX_AES_ROUNDS+1];
+    Block expected_keys[MAX_AES_ROUNDS+1];
+    Block dec_keys[MAX_AES_ROUNDS+1];
+    Block expected_dec_keys[MAX_AES_ROUNDS+1];
+    Block blocks[RANDOM_VECTORS_BLOCKS];
+    Block expected[RANDOM_VECTORS_BLOCKS];
+    size_t mismatches = 0;
+    for (size_t v = 0; v < TEST_VECTORS_COUNT; v++) {
+        size_t key_len = TEST_KEY_LENS[v];
+        for (size_t rounds = 1; rounds <= RANDOM_VECTORS_MAX_ROUNDS; rounds++) {
+            for (size_t t = 0; t < RANDOM_VECTORS_COUNT; t++) {
+                uint32_t key[8];
+                for (size_t i = 0; i < key_len; i++) key[i] = xorshift_next(&random_state);
+                backend->key_expansion(key, key_len, keys, rounds);
+                AES_REFERENCE->key_expansion(key, key_len, expected_keys, rounds);
+                backend->inv_key_expansion(keys, rounds, dec_keys);
+                AES_REFERENCE->inv_key_expansion(expected_keys, rounds, expected_dec_keys);
+                bool ok = memcmp(keys, expected_keys, sizeof(Block) * (rounds + 1)) == 0;
+                ok = ok && memcmp(dec_keys, expected_dec_keys, sizeof(Block) * (rounds + 1)) == 0;
+                for (size_t i = 0; i < RANDOM_VECTORS_BLOCKS; i++) {
+                    random_block(&blocks[i], &random_state);
+                    expected[i] = blocks[i];
+                    AES_REFERENCE->cipher_block(&expected[i], expected_keys, rounds);
+                }
+                Block state = blocks[0];
+                backend->cipher_block(&state, keys, rounds);
+                ok = ok && blocks_equal(&state, &expected[0]);
+                backend->decipher_block(&state, dec_keys, rounds);
+                ok = ok && blocks_equal(&state, &blocks[0]);
+                if (backend->cipher_blocks != NULL) {
+                    Block batch[RANDOM_VECTORS_BLOCKS];
+                    memcpy(batch, blocks, sizeof(batch));
+                    backend->cipher_blocks(batch, RANDOM_VECTORS_BLOCKS, keys, rounds);
+                    ok = ok && memcmp(batch, expected, sizeof(batch)) == 0;
+                    backend->decipher_blocks(batch, RANDOM_VECTORS_BLOCKS, dec_keys, rounds);
+                    ok = ok && memcmp(batch, blocks, sizeof(batch)) == 0;
+                }
+                mismatches += !ok;
+            }
+        }
+    }
+    printf("%s random vectors: %s\n", backend->name, mismatches == 0 ? "OK" : "MISMATCH");
+    return mismatches == 0;
+}
+
+// key_expansion_batch against the reference, with partial batches
+static bool check_key_batch() {
+    uint32_t random_state = 42;
+    uint32_t keys[KEY_BATCH_LANES * 8];
+    Block round_keys[KEY_BATCH_LANES][MAX_AES_ROUNDS+1];
+    Block expected[MAX_AES_ROUNDS+1];
+    KeyBatch batch;
+    size_t mismatches = 0;
+    for (size_t v = 0; v < TEST_VECTORS_COUNT; v++) {
+        size_t key_len = TEST_KEY_LENS[v];
+        for (size_t rounds = 1; rounds <= MAX_AES_ROUNDS; rounds++) {
+            if (key_len > 4 * (rounds + 1)) continue;
+            size_t count = 1 + xorshift_next(&random_state) % KEY_BATCH_LANES;
+            for (size_t i = 0; i < count * key_len; i++) keys[i] = xorshift_next(&random_state);
+            key_expansion_batch(keys, count, key_len, rounds, &batch);
+            key_batch_unpack(&batch, count, rounds, round_keys);
+            for (size_t lane = 0; lane < count; lane++) {
+                AES_REFERENCE->key_expansion(keys + lane * key_len, key_len, expected, rounds);
+                mismatches += memcmp(round_keys[lane], expected, sizeof(Block) * (rounds + 1)) != 0;
+            }
+        }
+    }
+    printf("batch key expansion: %s\n", mismatches == 0 ? "OK" : "MISMATCH");
+    return mismatches == 0;
+}
+
+static double time_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+#define BENCH_BLOCKS 4096
+#define BENCH_PASSES 256
+
+// block rates of every backend with AES-128, one block per call and whole
+// arrays for the backends with cipher_blocks
+static void bench_backends() {
+    uint32_t random_state = 42;
+    uint32_t key[4];
+    for (size_t i = 0; i < 4; i++) key[i] = xorshift_next(&random_state);
+    Block round_keys[MAX_AES_ROUNDS+1];
+    Block dec_keys[MAX_AES_ROUNDS+1];
+    key_expansion(key, 4, round_keys, 10);
+    inv_key_expansion(round_keys, 10, dec_keys);
+    Block* blocks = (Block*)malloc(sizeof(Block) * BENCH_BLOCKS);
+    for (size_t i = 0; i < BENCH_BLOCKS; i++) {
+        random_block(&blocks[i], &random_state);
+    }
+    double count = (double)BENCH_BLOCKS * BENCH_PASSES;
+    printf("backend\tencrypt\tdecrypt\n");
+    for (size_t b = 0; b < AES_BACKENDS_COUNT; b++) {
+        const AesBackend* backend = &AES_BACKENDS[b];
+        if (!backend_supported(backend)) continue;
+        double start = time_now();
+        for (size_t pass = 0; pass < BENCH_PASSES; pass++) {
+            for (size_t i = 0; i < BENCH_BLOCKS; i++) backend->cipher_block(&blocks[i], round_keys, 10);
+        }
+        double encrypt = time_now() - start;
+        start = time_now();
+        for (size_t pass = 0; pass < BENCH_PASSES; pass++) {
+            for (size_t i = 0; i < BENCH_BLOCKS; i++) backend->decipher_block(&blocks[i], dec_keys, 10);
+        }
+        double decrypt = time_now() - start;
+        printf("%s\t%.2fM blocks/s\t%.2fM blocks/s\n", backend->name, count / encrypt * 1e-6, count / decrypt * 1e-6);
+        if (backend->cipher_blocks == NULL) continue;
+        start = time_now();
+        for (size_t pass = 0; pass < BENCH_PASSES; pass++) {
+            backend->cipher_blocks(blocks, BENCH_BLOCKS, round_keys, 10);
+        }
+        encrypt = time_now() - start;
+        start = time_now();
+        for (size_t pass = 0; pass < BENCH_PASSES; pass++) {
+            backend->decipher_blocks(blocks, BENCH_BLOCKS, dec_keys, 10);
+        }
+        decrypt = time_now() - start;
+        printf("%s ecb\t%.2fM blocks/s\t%.2fM blocks/s\n", backend->name, count / encrypt * 1e-6, count / decrypt * 1e-6);
+    }
+    free(blocks);
+}
+
+#define KEY_BENCH_KEYS (1<<18)
+
+// AES-128 schedules per second one key at a time with the bulk backend and
+// KEY_BATCH_LANES at a time, the block rate above for comparison
+static void bench_key_expansion() {
+    const AesBackend* backend = bulk_backend();
+    uint32_t random_state = 42;
+    uint32_t keys[KEY_BATCH_LANES * 4];
+    for (size_t i = 0; i < KEY_BATCH_LANES * 4; i++) keys[i] = xorshift_next(&random_state);
+    Block round_keys[MAX_AES_ROUNDS+1];
+    KeyBatch batch;
+    uint32_t sink = 0;
+    double start = time_now();
+    for (size_t k = 0; k < KEY_BENCH_KEYS; k++) {
+        keys[k % (KEY_BATCH_LANES * 4)] += sink;
+        backend->key_expansion(keys + k % KEY_BATCH_LANES * 4, 4, round_keys, 10);
+        sink = round_keys[10].w[0];
+    }
+    double single = time_now() - start;
+    start = time_now();
+    for (size_t k = 0; k < KEY_BENCH_KEYS; k += KEY_BATCH_LANES) {
+        keys[k / KEY_BATCH_LANES % (KEY_BATCH_LANES * 4)] += sink;
+        key_expansion_batch(keys, KEY_BATCH_LANES, 4, 10, &batch);
+        sink = batch.w[4 * 10][0];
+    }
+    double batched = time_now() - start;
+    printf("\n%s key expansion\t%.2fM keys/s\n", backend->name, KEY_BENCH_KEYS / single * 1e-6);
+    printf("batch key expansion\t%.2fM keys/s\n", KEY_BENCH_KEYS / batched * 1e-6);
+}
+
+#define BATCH_SIZES_COUNT 5
+static const size_t BATCH_SIZES[BATCH_SIZES_COUNT] = { 1, 4, 8, 64, 4096 };
+// per measurement
+#define BATCH_BENCH_BYTES (1<<20)
+
+// time stamp counter ticks where there is one, nanoseconds elsewhere
+static uint64_t cycles_now() {
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// cycles per byte of AES-128 ECB by the number of blocks per call to the
+// array functions (the block by block loop for backends without them)
+static void bench_batches() {
+    uint32_t random_state = 42;
+    uint32_t key[4];
+    for (size_t i = 0; i < 4; i++) key[i] = xorshift_next(&random_state);
+    Block round_keys[MAX_AES_ROUNDS+1];
+    Block dec_keys[MAX_AES_ROUNDS+1];
+    key_expansion(key, 4, round_keys, 10);
+    inv_key_expansion(round_keys, 10, dec_keys);
+    Block* blocks = (Block*)malloc(sizeof(Block) * BENCH_BLOCKS);
+    for (size_t i = 0; i < BENCH_BLOCKS; i++) {
+        random_block(&blocks[i], &random_state);
+    }
+    printf("\ncycles/byte by batch");
+    for (size_t s = 0; s < BATCH_SIZES_COUNT; s++) printf("\t%zu", BATCH_SIZES[s]);
+    putchar('\n');
+    for (size_t b = 0; b < AES_BACKENDS_COUNT; b++) {
+        const AesBackend* backend = &AES_BACKENDS[b];
+        if (!backend_supported(backend)) continue;
+        for (int decrypt = 0; decrypt < 2; decrypt++) {
+            printf("%s %s", backend->name, decrypt ? "decrypt" : "encrypt");
+            for (size_t s = 0; s < BATCH_SIZES_COUNT; s++) {
+                size_t size = BATCH_SIZES[s];
+                uint64_t start = cycles_now();
+                for (size_t done = 0; done < BATCH_BENCH_BYTES / sizeof(Block); done += size) {
+                    Block* batch = &blocks[done % BENCH_BLOCKS];
+                    if (decrypt) {
+                        backend_decipher_blocks(backend, batch, size, dec_keys, 10);
+                    } else {
+                        backend_cipher_blocks(backend, batch, size, round_keys, 10);
+                    }
+                }
+                printf("\t%.2f", (double)(cycles_now() - start) / BATCH_BENCH_BYTES);
+            }
+            putchar('\n');
+        }
+    }
+    free(blocks);
+}
+
+static uint32_t block_diff_bits_count(const Block* a, const Block* b) {
+    uint64_t x[2], y[2];
+    memcpy(x, a, sizeof(x));
+    memcpy(y, b, sizeof(y));
+    return (uint32_t)(__builtin_popcountll(x[0] ^ y[0]) + __builtin_popcountll(x[1] ^ y[1]));
+}
+
+// splitmix64, a counter-based generator: substream s is the part of one
+// sequence from step s << SPLITMIX_STREAM_BITS on, so substreams never
+// overlap and each starts directly, without running the ones before it
+#define SPLITMIX_GOLDEN 0x9E3779B97F4A7C15ull
+#define SPLITMIX_STREAM_BITS 40
+
+typedef struct {
+    uint64_t counter;
+} SplitMix64;
+
+static void splitmix64_stream(SplitMix64* rng, uint64_t seed, uint64_t stream) {
+    assert(stream < (uint64_t)1 << (64 - SPLITMIX_STREAM_BITS));
+    rng->counter = seed + (stream << SPLITMIX_STREAM_BITS) * SPLITMIX_GOLDEN;
+}
+
+static uint64_t splitmix64_next(SplitMix64* rng) {
+    uint64_t z = rng->counter += SPLITMIX_GOLDEN;
+    z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ z >> 27) * 0x94D049BB133111EBull;
+    return z ^ z >> 31;
+}
+
+#define NUM_TESTS 100000
+#define ROUNDS_MIN 1
+#define ROUNDS_MAX 18
+#define ROUNDS_STEP 1
+
+// Trials are split into chunks of AVALANCHE_CHUNK, chunk c of round count r
+// drawing from substream r << AVALANCHE_CHUNK_BITS | c. Workers take chunks
+// round robin and the flip counts are integers summed per chunk, so the
+// results don't depend on the thread count
+#define AVALANCHE_SEED 42
+#define AVALANCHE_CHUNK (1<<16)
+#define AVALANCHE_CHUNK_BITS 16
+#define AVALANCHE_MAX_TESTS ((uint64_t)AVALANCHE_CHUNK << AVALANCHE_CHUNK_BITS)
+
+typedef struct {
+    const AesBackend* backend;
+    size_t rounds;
+    uint64_t tests;
+    size_t chunks;
+    uint64_t* flips_a; // per chunk
+    uint64_t* flips_b;
+} AvalancheJob;
+
+static void avalanche_chunk(const AvalancheJob* job, size_t chunk) {
+    const AesBackend* backend = job->backend;
+    size_t rounds = job->rounds;
+    SplitMix64 rng;
+    splitmix64_stream(&rng, AVALANCHE_SEED, (uint64_t)rounds << AVALANCHE_CHUNK_BITS | chunk);
+    uint64_t begin = (uint64_t)chunk * AVALANCHE_CHUNK;
+    uint64_t end = begin + AVALANCHE_CHUNK < job->tests ? begin + AVALANCHE_CHUNK : job->tests;
+    KeyBatch batch;
+    Block round_keys[KEY_BATCH_LANES][MAX_AES_ROUNDS+1];
+    Block flipped_round_keys[KEY_BATCH_LANES][MAX_AES_ROUNDS+1];
+    uint64_t flips_a = 0;
+    uint64_t flips_b = 0;
+    // the keys of KEY_BATCH_LANES tests are expanded together
+    for (uint64_t t = begin; t < end; t += KEY_BATCH_LANES) {
+        size_t count = end - t < KEY_BATCH_LANES ? (size_t)(end - t) : KEY_BATCH_LANES;
+        Block states[KEY_BATCH_LANES];
+        uint32_t keys[KEY_BATCH_LANES][4];
+        uint32_t flipped_keys[KEY_BATCH_LANES][4];
+        uint32_t aflips_at[KEY_BATCH_LANES];
+        for (size_t lane = 0; lane < count; lane++) {
+            // random state and key
+            uint64_t words[4];
+            for (size_t i = 0; i < 4; i++) words[i] = splitmix64_next(&rng);
+            memcpy(&states[lane], words, sizeof(Block));
+            memcpy(keys[lane], words + 2, sizeof(keys[lane]));
+            uint64_t flips = splitmix64_next(&rng);
+            aflips_at[lane] = flips & 127;
+            uint32_t bflip_at = flips >> 7 & 127;
+            memcpy(flipped_keys[lane], keys[lane], sizeof(keys[lane]));
+            flipped_keys[lane][bflip_at >> 5] ^= 1u << (bflip_at & 31);
+        }
+        key_expansion_batch(&keys[0][0], count, 4, rounds, &batch);
+        key_batch_unpack(&batch, count, rounds, round_keys);
+        key_expansion_batch(&flipped_keys[0][0], count, 4, rounds, &batch);
+        key_batch_unpack(&batch, count, rounds, flipped_round_keys);
+
+        for (size_t lane = 0; lane < count; lane++) {
+            // trivial case
+            Block state_trivial = states[lane];
+            backend->cipher_block(&state_trivial, round_keys[lane], rounds);
+
+            // a) flip single state bit
+            Block state_a = states[lane];
+            state_a.w[aflips_at[lane] >> 5] ^= 1u << (aflips_at[lane] & 31);
+            backend->cipher_block(&state_a, round_keys[lane], rounds);
+
+            // b) flip single key bit
+            Block state_b = states[lane];
+            backend->cipher_block(&state_b, flipped_round_keys[lane], rounds);
+
+            flips_a += block_diff_bits_count(&state_trivial, &state_a);
+            flips_b += block_diff_bits_count(&state_trivial, &state_b);
+        }
+    }
+    job->flips_a[chunk] = flips_a;
+    job->flips_b[chunk] = flips_b;
+}
+
+static void avalanche_worker(void* ctx, size_t worker, size_t workers) {
+    const AvalancheJob* job = (const AvalancheJob*)ctx;
+    for (size_t chunk = worker; chunk < job->chunks; chunk += workers) {
+        avalanche_chunk(job, chunk);
+    }
+}
+
+// average flipped bits after flipping one plaintext bit (a) or one key bit
+// (b) over `tests` random plaintexts and keys for each round count
+int lab_task(const AesBackend* backend, uint64_t tests, size_t threads) {
+    assert(1 <= tests && tests <= AVALANCHE_MAX_TESTS);
+    size_t chunks = (size_t)((tests + AVALANCHE_CHUNK - 1) / AVALANCHE_CHUNK);
+    uint64_t* flips_a = (uint64_t*)malloc(chunks * sizeof(uint64_t));
+    uint64_t* flips_b = (uint64_t*)malloc(chunks * sizeof(uint64_t));
+    if (flips_a == NULL || flips_b == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(flips_a);
+        free(flips_b);
+        return 1;
+    }
+    size_t workers = chunks < threads ? chunks : threads;
+
+    for (size_t round_count = ROUNDS_MIN; round_count <= ROUNDS_MAX; round_count += ROUNDS_STEP) {
+        AvalancheJob job = { backend, round_count, tests, chunks, flips_a, flips_b };
+        run_workers(workers, avalanche_worker, &job);
+        uint64_t total_a = 0;
+        uint64_t total_b = 0;
+        for (size_t c = 0; c < chunks; c++) {
+            total_a += flips_a[c];
+            total_b += flips_b[c];
+        }
+        double flip_average_a = (double)total_a / (double)tests;
+        double flip_average_b = (double)total_b / (double)tests;
+
+        printf("\n\n round count = %zu\n", round_count);
+        printf("a) av. flipped %.2lf/128 = %.8lf%%\n", flip_average_a, flip_average_a * (100. / 128.));
+        printf("b) av. flipped %.2lf/128 = %.8lf%%\n", flip_average_b, flip_average_b * (100. / 128.));
+    }
+    free(flips_a);
+    free(flips_b);
+    return 0;
+}
+
+// Strict avalanche criterion: for each round count the probability that
+// output bit o flips when input bit i of the plaintext, or of the key, is
+// flipped. A sample encrypts a random plaintext together with its 128
+// one-bit neighbours under one key schedule through the array functions,
+// then each of the 128 one-bit neighbours of the key. Output differences
+// are added to per input bit vertical counters (bit-plane ripple adds,
+// flushed into the matrix every SAC_FLUSH samples), which costs a few word
+// operations per input bit instead of 128 increments. Chunks and substreams
+// are those of the avalanche experiment and the counts are integers, so the
+// matrices don't depend on the thread count
+
+#define SAC_BITS 128
+_Static_assert(SAC_BITS % KEY_BATCH_LANES == 0, "key neighbours go by whole batches");
+#define SAC_PLANES 16
+#define SAC_FLUSH ((1u << SAC_PLANES) - 1)
+#define SAC_SEED 4242
+
+typedef struct {
+    uint64_t planes[SAC_BITS][SAC_PLANES][2];
+    uint32_t pending;
+    uint64_t counts[SAC_BITS][SAC_BITS];
+} SacCounter;
+
+static void sac_flush(SacCounter* counter) {
+    for (size_t i = 0; i < SAC_BITS; i++) {
+        for (size_t p = 0; p < SAC_PLANES; p++) {
+            for (size_t h = 0; h < 2; h++) {
+                uint64_t w = counter->planes[i][p][h];
+                while (w != 0) {
+                    counter->counts[i][h * 64 + (size_t)__builtin_ctzll(w)] += (uint64_t)1 << p;
+                    w &= w - 1;
+                }
+            }
+        }
+    }
+    memset(counter->planes, 0, sizeof(counter->planes));
+    counter->pending = 0;
+}
+
+// counts the bits of a ^ b for input bit i
+static void sac_add(SacCounter* counter, size_t i, const Block* a, const Block* b) {
+    uint64_t x[2], y[2];
+    memcpy(x, a, sizeof(x));
+    memcpy(y, b, sizeof(y));
+    uint64_t carry_lo = x[0] ^ y[0];
+    uint64_t carry_hi = x[1] ^ y[1];
+    for (size_t p = 0; (carry_lo | carry_hi) != 0; p++) {
+        uint64_t* plane = counter->planes[i][p];
+        uint64_t next_lo = plane[0] & carry_lo;
+        uint64_t next_hi = plane[1] & carry_hi;
+        plane[0] ^= carry_lo;
+        plane[1] ^= carry_hi;
+        carry_lo = next_lo;
+        carry_hi = next_hi;
+    }
+}
+
+static void sac_sample_done(SacCounter* counter) {
+    counter->pending += 1;
+    if (counter->pending == SAC_FLUSH) sac_flush(counter);
+}
+
+typedef struct {
+    const AesBackend* backend;
+    size_t rounds;
+    uint64_t samples;
+    size_t chunks;
+    SacCounter* plain; // per worker
+    SacCounter* key;
+} SacJob;
+
+static void sac_chunk(const SacJob* job, SacCounter* plain, SacCounter* key_counter, size_t chunk) {
+    const AesBackend* backend = job->backend;
+    size_t rounds = job->rounds;
+    SplitMix64 rng;
+    splitmix64_stream(&rng, SAC_SEED, (uint64_t)rounds << AVALANCHE_CHUNK_BITS | chunk);
+    uint64_t begin = (uint64_t)chunk * AVALANCHE_CHUNK;
+    uint64_t end = begin + AVALANCHE_CHUNK < job->samples ? begin + AVALANCHE_CHUNK : job->samples;
+    Block round_keys[MAX_AES_ROUNDS+1];
+    Block blocks[SAC_BITS + 1];
+    KeyBatch batch;
+    Block batch_round_keys[KEY_BATCH_LANES][MAX_AES_ROUNDS+1];
+    for (uint64_t t = begin; t < end; t++) {
+        uint64_t words[4];
+        for (size_t i = 0; i < 4; i++) words[i] = splitmix64_next(&rng);
+        Block state_orig;
+        memcpy(&state_orig, words, sizeof(Block));
+        uint32_t key[4];
+        memcpy(key, words + 2, sizeof(key));
+
+        // the plaintext and its neighbours under one schedule
+        backend->key_expansion(key, 4, round_keys, rounds);
+        for (size_t i = 0; i <= SAC_BITS; i++) blocks[i] = state_orig;
+        for (size_t i = 0; i < SAC_BITS; i++) blocks[i + 1].w[i >> 5] ^= 1u << (i & 31);
+        backend_cipher_blocks(backend, blocks, SAC_BITS + 1, round_keys, rounds);
+        for (size_t i = 0; i < SAC_BITS; i++) sac_add(plain, i, &blocks[0], &blocks[i + 1]);
+        sac_sample_done(plain);
+
+        // the key neighbours, KEY_BATCH_LANES schedules at a time
+        for (size_t first = 0; first < SAC_BITS; first += KEY_BATCH_LANES) {
+            uint32_t keys[KEY_BATCH_LANES][4];
+            for (size_t lane = 0; lane < KEY_BATCH_LANES; lane++) {
+                size_t i = first + lane;
+                memcpy(keys[lane], key, sizeof(key));
+                keys[lane][i >> 5] ^= 1u << (i & 31);
+            }
+            key_expansion_batch(&keys[0][0], KEY_BATCH_LANES, 4, rounds, &batch);
+            key_batch_unpack(&batch, KEY_BATCH_LANES, rounds, batch_round_keys);
+            for (size_t lane = 0; lane < KEY_BATCH_LANES; lane++) {
+                Block state = state_orig;
+                backend->cipher_block(&state, batch_round_keys[lane], rounds);
+                sac_add(key_counter, first + lane, &blocks[0], &state);
+            }
+        }
+        sac_sample_done(key_counter);
+    }
+}
+
+static void sac_worker(void* ctx, size_t worker, size_t workers) {
+    const SacJob* job = (const SacJob*)ctx;
+    SacCounter* plain = &job->plain[worker];
+    SacCounter* key = &job->key[worker];
+    memset(plain, 0, sizeof(SacCounter));
+    memset(key, 0, sizeof(SacCounter));
+    for (size_t chunk = worker; chunk < job->chunks; chunk += workers) {
+        sac_chunk(job, plain, key, chunk);
+    }
+    sac_flush(plain);
+    sac_flush(key);
+}
+
+// sums the workers' counts into the first and writes its rows as
+// "flip,rounds,in_bit,p_0,..,p_127", returns the largest |p - 1/2|
+static double sac_write_rows(FILE* file, const char* flip, size_t rounds, SacCounter* counters, size_t workers, uint64_t samples) {
+    for (size_t w = 1; w < workers; w++) {
+        for (size_t i = 0; i < SAC_BITS; i++) {
+            for (size_t o = 0; o < SAC_BITS; o++) counters[0].counts[i][o] += counters[w].counts[i][o];
+        }
+    }
+    double max_bias = 0.;
+    for (size_t i = 0; i < SAC_BITS; i++) {
+        fprintf(file, "%s,%zu,%zu", flip, rounds, i);
+        for (size_t o = 0; o < SAC_BITS; o++) {
+            double p = (double)counters[0].counts[i][o] / (double)samples;
+            double bias = p > 0.5 ? p - 0.5 : 0.5 - p;
+            if (bias > max_bias) max_bias = bias;
+            fprintf(file, ",%.8f", p);
+        }
+        fputc('\n', file);
+    }
+    return max_bias;
+}
+
+// SAC matrices of every round count into a CSV file
+static int task_sac(const AesBackend* backend, uint64_t samples, size_t threads, const char* path) {
+    assert(1 <= samples && samples <= AVALANCHE_MAX_TESTS);
+    size_t chunks = (size_t)((samples + AVALANCHE_CHUNK - 1) / AVALANCHE_CHUNK);
+    size_t workers = chunks < threads ? chunks : threads;
+    SacCounter* plain = (SacCounter*)malloc(workers * sizeof(SacCounter));
+    SacCounter* key = (SacCounter*)malloc(workers * sizeof(SacCounter));
+    if (plain == NULL || key == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(plain);
+        free(key);
+        return 1;
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        free(plain);
+        free(key);
+        return 1;
+    }
+    fprintf(file, "flip,rounds,in_bit");
+    for (size_t o = 0; o < SAC_BITS; o++) fprintf(file, ",out_%zu", o);
+    fputc('\n', file);
+    for (size_t round_count = ROUNDS_MIN; round_count <= ROUNDS_MAX; round_count += ROUNDS_STEP) {
+        SacJob job = { backend, round_count, samples, chunks, plain, key };
+        run_workers(workers, sac_worker, &job);
+        double plain_bias = sac_write_rows(file, "plain", round_count, plain, workers, samples);
+        double key_bias = sac_write_rows(file, "key", round_count, key, workers, samples);
+        printf("round count = %zu: max |p - 1/2| plaintext %.6f, key %.6f\n", round_count, plain_bias, key_bias);
+    }
+    free(plain);
+    free(key);
+    return fclose(file) == 0 ? 0 : 1;
+}
+
+// SP 800-38A F.5.1, CTR-AES128
+static const uint32_t CTR_TEST_KEY[4] = { 0x2B7E1516, 0x28AED2A6, 0xABF71588, 0x09CF4F3C };
+static const uint32_t CTR_TEST_IV[4] = { 0xF0F1F2F3, 0xF4F5F6F7, 0xF8F9FAFB, 0xFCFDFEFF };
+static const uint32_t CTR_TEST_PLAIN[8] = {
+    0x6BC1BEE2, 0x2E409F96, 0xE93D7E11, 0x7393172A, 0xAE2D8A57, 0x1E03AC9C, 0x9EB76FAC, 0x45AF8E51,
+};
+static const uint32_t CTR_TEST_CIPHER[8] = {
+    0x874D6191, 0xB620E326, 0x1BEF6864, 0x990DB6CE, 0x9806F66B, 0x7970FDFF, 0x8617187B, 0xB9FFFDFF,
+};
+
+#define CTR_CHECK_LEN ((1<<20) + 13)
+#define CTR_CHECK_SEEKS 256
+#define CTR_BENCH_LEN (1<<21)
+// per backend
+#define CTR_BENCH_SECONDS 0.5
+
+// the vector and random seeks on every backend, then throughput
+static int task_ctr(size_t threads) {
+    Block round_keys[MAX_AES_ROUNDS+1];
+    key_expansion(CTR_TEST_KEY, 4, round_keys, 10);
+    Block iv = block_from_words_ne(CTR_TEST_IV);
+    Block expected[2] = { block_from_words_ne(CTR_TEST_CIPHER), block_from_words_ne(CTR_TEST_CIPHER + 4) };
+    uint8_t* plain = (uint8_t*)malloc(CTR_CHECK_LEN);
+    uint8_t* whole = (uint8_t*)malloc(CTR_CHECK_LEN);
+    uint8_t* piece = (uint8_t*)malloc(CTR_CHECK_LEN);
+    uint32_t random_state = 42;
+    for (size_t i = 0; i < CTR_CHECK_LEN; i++) plain[i] = (uint8_t)xorshift_next(&random_state);
+    bool ok = true;
+    for (size_t b = 0; b < AES_BACKENDS_COUNT; b++) {
+        const AesBackend* backend = &AES_BACKENDS[b];
+        if (!backend_supported(backend)) continue;
+        AesCtr ctr;
+        aes_ctr_init(&ctr, backend, round_keys, 10, &iv);
+        Block data[2] = { block_from_words_ne(CTR_TEST_PLAIN), block_from_words_ne(CTR_TEST_PLAIN + 4) };
+        aes_ctr_apply(&ctr, 0, (uint8_t*)data, sizeof(data));
+        bool vector = memcmp(data, expected, sizeof(data)) == 0;
+
+        memcpy(whole, plain, CTR_CHECK_LEN);
+        aes_ctr_apply_parallel(&ctr, 0, whole, CTR_CHECK_LEN, threads);
+        size_t seek_errors = 0;
+        for (size_t t = 0; t < CTR_CHECK_SEEKS; t++) {
+            size_t offset = xorshift_next(&random_state) % CTR_CHECK_LEN;
+            size_t len = xorshift_next(&random_state) % (CTR_CHECK_LEN - offset + 1);
+            memcpy(piece, plain + offset, len);
+            aes_ctr_apply_parallel(&ctr, offset, piece, len, threads);
+            seek_errors += memcmp(piece, whole + offset, len) != 0;
+        }
+        printf("%s ctr: vector %s, seeks %s\n", backend->name, vector ? "OK" : "MISMATCH", seek_errors == 0 ? "OK" : "MISMATCH");
+        ok = ok && vector && seek_errors == 0;
+    }
+    free(plain);
+    free(whole);
+    free(piece);
+
+    uint8_t* buf = (uint8_t*)malloc(CTR_BENCH_LEN);
+    memset(buf, 0, CTR_BENCH_LEN);
+    printf("backend\t%zu thr\n", threads);
+    for (size_t b = 0; b < AES_BACKENDS_COUNT; b++) {
+        const AesBackend* backend = &AES_BACKENDS[b];
+        if (!backend_supported(backend)) continue;
+        AesCtr ctr;
+        aes_ctr_init(&ctr, backend, round_keys, 10, &iv);
+        double start = time_now();
+        double elapsed = 0.;
+        size_t passes = 0;
+        for (; elapsed < CTR_BENCH_SECONDS; passes++) {
+            aes_ctr_apply_parallel(&ctr, 0, buf, CTR_BENCH_LEN, threads);
+            elapsed = time_now() - start;
+        }
+        printf("%s\t%.2f GB/s\n", backend->name, (double)CTR_BENCH_LEN * (double)passes / elapsed * 1e-9);
+    }
+    free(buf);
+    return ok ? 0 : 1;
+}
+
+// GCM test cases 1-4 of the GCM specification (McGrew & Viega), AES-128
+typedef struct {
+    const char* key;
+    const char* iv;
+    const char* aad;
+    const char* plain;
+    const char* cipher;
+    const char* tag;
+} GcmVector;
+
+#define GCM_VECTORS_COUNT 4
+static const GcmVector GCM_VECTORS[GCM_VECTORS_COUNT] = {
+    {
+        "00000000000000000000000000000000", "000000000000000000000000", "", "", "",
+        "58e2fccefa7e3061367f1d57a4e7455a",
+    },
+    {
+        "00000000000000000000000000000000", "000000000000000000000000", "",
+        "00000000000000000000000000000000",
+        "0388dace60b6a392f328c2b971b2fe78",
+        "ab6e47d42cec13bdf53a67b21257bddf",
+    },
+    {
+        "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+        "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+        "4d5c2af327cd64a62cf35abd2ba6fab4",
+    },
+    {
+        "feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+        "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+        "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+        "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+        "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+        "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+        "5bc94fbc3221a5db94fae95ae7121a47",
+    },
+};
+
+#define GCM_VECTOR_MAX_LEN 64
+
+// decodes a hex string, returns the byte count
+static size_t hex_bytes(const char* hex, uint8_t* out) {
+    size_t len = strlen(hex) / 2;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        sscanf(hex + 2 * i, "%2x", &byte);
+        out[i] = (uint8_t)byte;
+    }
+    return len;
+}
+
+// key_expansion takes words with the first byte on top
+static void key_words_from_bytes(const uint8_t* bytes, size_t key_len, uint32_t* words) {
+    for (size_t i = 0; i < key_len; i++) {
+        uint32_t word;
+        memcpy(&word, bytes + 4 * i, 4);
+        words[i] = __builtin_bswap32(word);
+    }
+}
+
+// encrypts and decrypts a vector, then checks a flipped tag is rejected
+static bool check_gcm_vector(const AesBackend* backend, bool clmul, const GcmVector* vector) {
+    uint8_t key[16], iv[16], aad[GCM_VECTOR_MAX_LEN], plain[GCM_VECTOR_MAX_LEN], cipher[GCM_VECTOR_MAX_LEN];
+    uint8_t tag[GCM_TAG_LEN], data[GCM_VECTOR_MAX_LEN], out_tag[GCM_TAG_LEN];
+    hex_bytes(vector->key, key);
+    size_t iv_len = hex_bytes(vector->iv, iv);
+    size_t aad_len = hex_bytes(vector->aad, aad);
+    size_t len = hex_bytes(vector->plain, plain);
+    hex_bytes(vector->cipher, cipher);
+    hex_bytes(vector->tag, tag);
+
+    uint32_t key_words[4];
+    key_words_from_bytes(key, 4, key_words);
+    Block round_keys[MAX_AES_ROUNDS+1];
+    backend->key_expansion(key_words, 4, round_keys, 10);
+    AesGcm gcm;
+    aes_gcm_init(&gcm, backend, round_keys, 10, clmul);
+
+    memcpy(data, plain, len);
+    aes_gcm_encrypt(&gcm, iv, iv_len, aad, aad_len, data, len, out_tag);
+    bool ok = memcmp(data, cipher, len) == 0 && memcmp(out_tag, tag, GCM_TAG_LEN) == 0;
+    ok = aes_gcm_decrypt(&gcm, iv, iv_len, aad, aad_len, data, len, tag) && ok;
+    ok = ok && memcmp(data, plain, len) == 0;
+    tag[GCM_TAG_LEN - 1] ^= 1;
+    memcpy(data, cipher, len);
+    ok = !aes_gcm_decrypt(&gcm, iv, iv_len, aad, aad_len, data, len, tag) && ok;
+    return ok;
+}
+
+#define GCM_CROSS_CHECKS 64
+#define GCM_CROSS_MAX_LEN 3000
+#define GCM_CROSS_MAX_IV_LEN 40
+#define GCM_BENCH_LEN (1<<21)
+// per GHASH variant
+#define GCM_BENCH_SECONDS 0.5
+
+// the PCLMULQDQ GHASH against the tables on random lengths and IV sizes
+static bool check_gcm_cross(const AesBackend* backend) {
+    uint32_t random_state = 42;
+    uint32_t key_words[4];
+    Block round_keys[MAX_AES_ROUNDS+1];
+    uint8_t iv[GCM_CROSS_MAX_IV_LEN], aad[GCM_CROSS_MAX_LEN], a[GCM_CROSS_MAX_LEN], b[GCM_CROSS_MAX_LEN];
+    uint8_t tag_a[GCM_TAG_LEN], tag_b[GCM_TAG_LEN];
+    bool ok = true;
+    for (size_t t = 0; t < GCM_CROSS_CHECKS; t++) {
+        for (size_t i = 0; i < 4; i++) key_words[i] = xorshift_next(&random_state);
+        backend->key_expansion(key_words, 4, round_keys, 10);
+        AesGcm clmul, table;
+        aes_gcm_init(&clmul, backend, round_keys, 10, true);
+        aes_gcm_init(&table, backend, round_keys, 10, false);
+        size_t iv_len = 1 + xorshift_next(&random_state) % GCM_CROSS_MAX_IV_LEN;
+        size_t aad_len = xorshift_next(&random_state) % GCM_CROSS_MAX_LEN;
+        size_t len = xorshift_next(&random_state) % GCM_CROSS_MAX_LEN;
+        for (size_t i = 0; i < iv_len; i++) iv[i] = (uint8_t)xorshift_next(&random_state);
+        for (size_t i = 0; i < aad_len; i++) aad[i] = (uint8_t)xorshift_next(&random_state);
+        for (size_t i = 0; i < len; i++) a[i] = b[i] = (uint8_t)xorshift_next(&random_state);
+        aes_gcm_encrypt(&clmul, iv, iv_len, aad, aad_len, a, len, tag_a);
+        aes_gcm_encrypt(&table, iv, iv_len, aad, aad_len, b, len, tag_b);
+        ok = ok && memcmp(a, b, len) == 0 && memcmp(tag_a, tag_b, GCM_TAG_LEN) == 0;
+        ok = ok && aes_gcm_decrypt(&table, iv, iv_len, aad, aad_len, a, len, tag_a);
+    }
+    return ok;
+}
+
+// the vectors with every backend and GHASH variant, then throughput
+static int task_gcm() {
+    bool ok = true;
+#ifdef __SSE2__
+    bool has_clmul = clmul_supported();
+#else
+    bool has_clmul = false;
+#endif
+    for (size_t b = 0; b < AES_BACKENDS_COUNT; b++) {
+        const AesBackend* backend = &AES_BACKENDS[b];
+        if (!backend_supported(backend)) continue;
+        for (int clmul = has_clmul; clmul >= 0; clmul--) {
+            size_t passed = 0;
+            for (size_t i = 0; i < GCM_VECTORS_COUNT; i++) {
+                passed += check_gcm_vector(backend, clmul, &GCM_VECTORS[i]);
+            }
+            printf("%s gcm (%s): vectors %zu/%d %s\n", backend->name, clmul ? "pclmul" : "4-bit",
+                   passed, GCM_VECTORS_COUNT, passed == GCM_VECTORS_COUNT ? "OK" : "MISMATCH");
+            ok = ok && passed == GCM_VECTORS_COUNT;
+        }
+    }
+    if (has_clmul) {
+        bool cross = check_gcm_cross(bulk_backend());
+        printf("pclmul vs 4-bit: %s\n", cross ? "OK" : "MISMATCH");
+        ok = ok && cross;
+    }
+
+    const AesBackend* backend = bulk_backend();
+    uint32_t key_words[4] = {0};
+    Block round_keys[MAX_AES_ROUNDS+1];
+    backend->key_expansion(key_words, 4, round_keys, 10);
+    uint8_t iv[12] = {0};
+    uint8_t tag[GCM_TAG_LEN];
+    uint8_t* buf = (uint8_t*)malloc(GCM_BENCH_LEN);
+    memset(buf, 0, GCM_BENCH_LEN);
+    for (int clmul = has_clmul; clmul >= 0; clmul--) {
+        AesGcm gcm;
+        aes_gcm_init(&gcm, backend, round_keys, 10, clmul);
+        double start = time_now();
+        double elapsed = 0.;
+        size_t passes = 0;
+        for (; elapsed < GCM_BENCH_SECONDS; passes++) {
+            aes_gcm_encrypt(&gcm, iv, sizeof(iv), NULL, 0, buf, GCM_BENCH_LEN, tag);
+            elapsed = time_now() - start;
+        }
+        printf("%s gcm (%s)\t%.2f GB/s\n", backend->name, clmul ? "pclmul" : "4-bit",
+               (double)GCM_BENCH_LEN * (double)passes / elapsed * 1e-9);
+    }
+    free(buf);
+    return ok ? 0 : 1;
+}
+
+// File encryption
+//
+// The data goes through FILE_BUFFERS aligned buffers of FILE_CHUNK bytes,
+// allocated once. An I/O thread writes out the chunk before last and reads
+// the next one into the same buffer while the calling thread (and, for CTR,
+// its workers) en/decrypts the current one, so the disk and the cipher work
+// at the same time. Output files are the IV, the data (PKCS#7 padded for
+// CBC) and, for GCM, the tag. GCM decryption can only check the tag after
+// the plaintext is written, so the output goes to a temporary file that
+// replaces the destination only once everything checked out.
+
+#define FILE_CHUNK (1<<23)
+#define FILE_ALIGN 4096
+#define FILE_BUFFERS 2
+#define FILE_GCM_IV_LEN 12
+
+typedef enum {
+    FILE_CTR,
+    FILE_CBC,
+    FILE_GCM,
+} FileMode;
+
+typedef enum {
+    FILE_BUFFER_EMPTY,
+    FILE_BUFFER_FULL, // read, waits for the cipher
+    FILE_BUFFER_DONE, // en/decrypted, waits for the write
+} FileBufferState;
+
+typedef struct {
+    uint8_t* data; // FILE_CHUNK and a block for the CBC padding
+    size_t len;
+    size_t out_len;
+    bool last;
+    FileBufferState state;
+} FileBuffer;
+
+typedef struct {
+    int in;
+    int out;
+    uint64_t in_offset;
+    uint64_t out_offset;
+    uint64_t len;
+    uint64_t written; // output bytes, len less the padding after CBC decryption
+    size_t chunks;
+    FileBuffer buffers[FILE_BUFFERS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool stop;
+    bool io_failed;
+    int io_errno; // errno is per thread, the I/O thread's is kept here
+} FilePipe;
+
+typedef struct {
+    FileMode mode;
+    bool encrypt;
+    const AesBackend* backend;
+    Block round_keys[MAX_AES_ROUNDS+1];
+    Block dec_keys[MAX_AES_ROUNDS+1];
+    size_t rounds;
+    size_t threads;
+    AesCtr ctr;
+    uint64_t ctr_offset;
+    Block cbc_iv;
+    AesGcm gcm;
+    AesGcmStream gcm_stream;
+} FileCipher;
+
+static bool pread_all(int fd, uint8_t* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        // the file got shorter than its size
+        if (n == 0) errno = EIO;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+// false if the pipe was stopped instead
+static bool file_pipe_wait(FilePipe* pipe, FileBuffer* buffer, FileBufferState state) {
+    pthread_mutex_lock(&pipe->lock);
+    while (buffer->state != state && !pipe->stop) pthread_cond_wait(&pipe->changed, &pipe->lock);
+    bool ok = !pipe->stop;
+    pthread_mutex_unlock(&pipe->lock);
+    return ok;
+}
+
+static void file_pipe_set(FilePipe* pipe, FileBuffer* buffer, FileBufferState state) {
+    pthread_mutex_lock(&pipe->lock);
+    buffer->state = state;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static void file_pipe_stop(FilePipe* pipe) {
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = true;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// chunk k is read into buffer k % FILE_BUFFERS right after chunk
+// k - FILE_BUFFERS is written from it
+static void* file_pipe_io(void* arg) {
+    FilePipe* pipe = (FilePipe*)arg;
+    for (size_t k = 0; k < pipe->chunks + FILE_BUFFERS; k++) {
+        FileBuffer* buffer = &pipe->buffers[k % FILE_BUFFERS];
+        if (k >= FILE_BUFFERS) {
+            if (!file_pipe_wait(pipe, buffer, FILE_BUFFER_DONE)) break;
+            if (!pwrite_all(pipe->out, buffer->data, buffer->out_len, pipe->out_offset + pipe->written)) {
+                pipe->io_failed = true;
+                pipe->io_errno = errno;
+                file_pipe_stop(pipe);
+                break;
+            }
+            pipe->written += buffer->out_len;
+        }
+        if (k < pipe->chunks) {
+            uint64_t begin = (uint64_t)k * FILE_CHUNK;
+            buffer->len = pipe->len - begin < FILE_CHUNK ? (size_t)(pipe->len - begin) : FILE_CHUNK;
+            buffer->last = k + 1 == pipe->chunks;
+            if (!pread_all(pipe->in, buffer->data, buffer->len, pipe->in_offset + begin)) {
+                pipe->io_failed = true;
+                pipe->io_errno = errno;
+                file_pipe_stop(pipe);
+                break;
+            }
+            file_pipe_set(pipe, buffer, FILE_BUFFER_FULL);
+        }
+    }
+    return NULL;
+}
+
+// en/decrypts a chunk in place, false on bad CBC padding
+static bool file_cipher_chunk(FileCipher* cipher, FileBuffer* buffer) {
+    uint8_t* data = buffer->data;
+    size_t len = buffer->len;
+    buffer->out_len = len;
+    switch (cipher->mode) {
+    case FILE_CTR:
+        aes_ctr_apply_parallel(&cipher->ctr, cipher->ctr_offset, data, len, cipher->threads);
+        cipher->ctr_offset += len;
+        return true;
+    case FILE_GCM:
+        aes_gcm_update(&cipher->gcm_stream, data, len, cipher->encrypt);
+        return true;
+    case FILE_CBC:
+        if (cipher->encrypt) {
+            if (buffer->last) {
+                uint8_t pad = (uint8_t)(sizeof(Block) - len % sizeof(Block));
+                memset(data + len, pad, pad);
+                len += pad;
+                buffer->out_len = len;
+            }
+            aes_cbc_encrypt(cipher->backend, cipher->round_keys, cipher->rounds, &cipher->cbc_iv, (Block*)data, len / sizeof(Block));
+            return true;
+        }
+        aes_cbc_decrypt_parallel(cipher->backend, cipher->dec_keys, cipher->rounds, &cipher->cbc_iv, (Block*)data, len / sizeof(Block), cipher->threads);
+        if (buffer->last) {
+            uint8_t pad = data[len - 1];
+            if (pad == 0 || pad > sizeof(Block)) return false;
+            for (size_t i = len - pad; i < len; i++) {
+                if (data[i] != pad) return false;
+            }
+            buffer->out_len = len - pad;
+        }
+        return true;
+    }
+    return false;
+}
+
+// runs the pipe with the cipher on this thread
+static bool file_pipe_run(FilePipe* pipe, FileCipher* cipher) {
+    pipe->chunks = pipe->len == 0 ? 1 : (size_t)((pipe->len + FILE_CHUNK - 1) / FILE_CHUNK);
+    pipe->stop = false;
+    pipe->io_failed = false;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->changed, NULL);
+    size_t buffer_size = (FILE_CHUNK + sizeof(Block) + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+    // aligned_alloc takes whole multiples of the alignment
+    assert(buffer_size % FILE_ALIGN == 0);
+    bool ok = true;
+    for (size_t i = 0; i < FILE_BUFFERS; i++) {
+        pipe->buffers[i].data = (uint8_t*)aligned_alloc(FILE_ALIGN, buffer_size);
+        pipe->buffers[i].state = FILE_BUFFER_EMPTY;
+        ok = ok && pipe->buffers[i].data != NULL;
+    }
+    pthread_t io;
+    if (!ok) {
+        fprintf(stderr, "out of memory\n");
+    } else if (pthread_create(&io, NULL, file_pipe_io, pipe) != 0) {
+        ok = false;
+    } else {
+        for (size_t k = 0; k < pipe->chunks; k++) {
+            FileBuffer* buffer = &pipe->buffers[k % FILE_BUFFERS];
+            if (!file_pipe_wait(pipe, buffer, FILE_BUFFER_FULL)) break;
+            if (!file_cipher_chunk(cipher, buffer)) {
+                fprintf(stderr, "bad padding\n");
+                ok = false;
+                file_pipe_stop(pipe);
+                break;
+            }
+            file_pipe_set(pipe, buffer, FILE_BUFFER_DONE);
+        }
+        pthread_join(io, NULL);
+    }
+    if (pipe->io_failed) fprintf(stderr, "file i/o: %s\n", strerror(pipe->io_errno));
+    for (size_t i = 0; i < FILE_BUFFERS; i++) free(pipe->buffers[i].data);
+    pthread_cond_destroy(&pipe->changed);
+    pthread_mutex_destroy(&pipe->lock);
+    return ok && !pipe->io_failed;
+}
+
+// 32, 48 or 64 hex digits into key words, the key length in words or 0
+static size_t parse_key_hex(const char* hex, uint32_t* key) {
+    size_t len = strlen(hex);
+    if ((len != 32 && len != 48 && len != 64) || strspn(hex, "0123456789abcdefABCDEF") != len) return 0;
+    uint8_t bytes[32];
+    hex_bytes(hex, bytes);
+    key_words_from_bytes(bytes, len / 8, key);
+    return len / 8;
+}
+
+static bool random_bytes(uint8_t* data, size_t len) {
+    FILE* file = fopen("/dev/urandom", "rb");
+    if (file == NULL) return false;
+    bool ok = fread(data, 1, len, file) == len;
+    fclose(file);
+    return ok;
+}
+
+// en/decrypts in_path into out_path
+// Opens a new file next to path, where a rename can later replace path,
+// with the permissions open(path, O_CREAT, 0644) would give it. Its name
+// is left in *tmp_path, to be freed; -1 on failure
+static int create_temp_beside(const char* path, char** tmp_path) {
+    *tmp_path = (char*)malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (*tmp_path == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    sprintf(*tmp_path, "%s.XXXXXX", path);
+    int fd = mkstemp(*tmp_path);
+    if (fd < 0) {
+        perror(*tmp_path);
+        return -1;
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    if (fchmod(fd, 0644 & ~mask) != 0) {
+        perror(*tmp_path);
+        close(fd);
+        unlink(*tmp_path);
+        return -1;
+    }
+    return fd;
+}
+
+static int task_file(const AesBackend* backend, bool encrypt, FileMode mode, const char* key_hex,
+                     const char* in_path, const char* out_path, size_t threads) {
+    uint32_t key[8];
+    size_t key_len = parse_key_hex(key_hex, key);
+    if (key_len == 0) {
+        fprintf(stderr, "the key must be 32, 48 or 64 hex digits\n");
+        return 1;
+    }
+    FileCipher* cipher = (FileCipher*)malloc(sizeof(FileCipher));
+    if (cipher == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    cipher->mode = mode;
+    cipher->encrypt = encrypt;
+    cipher->backend = backend;
+    cipher->rounds = key_len + 6;
+    cipher->threads = threads;
+    backend->key_expansion(key, key_len, cipher->round_keys, cipher->rounds);
+    backend->inv_key_expansion(cipher->round_keys, cipher->rounds, cipher->dec_keys);
+
+    FilePipe pipe;
+    pipe.in = open(in_path, O_RDONLY);
+    if (pipe.in < 0) {
+        perror(in_path);
+        free(cipher);
+        return 1;
+    }
+    struct stat st;
+    bool ok = fstat(pipe.in, &st) == 0;
+    if (!ok) perror(in_path);
+    uint64_t in_len = ok ? (uint64_t)st.st_size : 0;
+    size_t iv_len = mode == FILE_GCM ? FILE_GCM_IV_LEN : sizeof(Block);
+    size_t tag_len = mode == FILE_GCM ? GCM_TAG_LEN : 0;
+    uint8_t iv[sizeof(Block)] = {0};
+    uint8_t tag[GCM_TAG_LEN];
+    if (encrypt) {
+        ok = ok && random_bytes(iv, iv_len);
+        pipe.len = in_len;
+        pipe.in_offset = 0;
+    } else {
+        bool valid = ok && in_len >= iv_len + tag_len && pread_all(pipe.in, iv, iv_len, 0);
+        valid = valid && (tag_len == 0 || pread_all(pipe.in, tag, tag_len, in_len - tag_len));
+        pipe.len = valid ? in_len - iv_len - tag_len : 0;
+        pipe.in_offset = iv_len;
+        if (valid && mode == FILE_CBC && (pipe.len == 0 || pipe.len % sizeof(Block) != 0)) valid = false;
+        if (ok && !valid) fprintf(stderr, "%s is not a %s file\n", in_path, mode == FILE_CTR ? "ctr" : mode == FILE_CBC ? "cbc" : "gcm");
+        ok = valid;
+    }
+    if (ok && mode == FILE_GCM && pipe.len > GCM_MAX_LEN) {
+        fprintf(stderr, "%s is over the %llu bytes gcm allows\n", in_path, (unsigned long long)GCM_MAX_LEN);
+        ok = false;
+    }
+    pipe.out_offset = encrypt ? iv_len : 0;
+
+    // the input is only known good once it is checked, and the output is
+    // renamed into place only after that, so no failure touches out_path
+    struct stat out_st;
+    if (ok && stat(out_path, &out_st) == 0 && out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino) {
+        fprintf(stderr, "%s and %s are the same file\n", in_path, out_path);
+        ok = false;
+    }
+    char* tmp_path = NULL;
+    pipe.out = ok ? create_temp_beside(out_path, &tmp_path) : -1;
+    ok = ok && pipe.out >= 0;
+    if (ok && encrypt) {
+        ok = pwrite_all(pipe.out, iv, iv_len, 0);
+        if (!ok) perror(tmp_path);
+    }
+
+    memcpy(&cipher->cbc_iv, iv, sizeof(Block));
+    aes_ctr_init(&cipher->ctr, backend, cipher->round_keys, cipher->rounds, &cipher->cbc_iv);
+    cipher->ctr_offset = 0;
+    if (mode == FILE_GCM) {
+        aes_gcm_init(&cipher->gcm, backend, cipher->round_keys, cipher->rounds, true);
+        aes_gcm_start(&cipher->gcm_stream, &cipher->gcm, iv, iv_len, NULL, 0);
+    }
+
+    pipe.written = 0;
+    double start = time_now();
+    ok = ok && file_pipe_run(&pipe, cipher);
+    double elapsed = time_now() - start;
+    if (ok && mode == FILE_GCM) {
+        uint8_t computed[GCM_TAG_LEN];
+        aes_gcm_finish(&cipher->gcm_stream, computed);
+        if (encrypt) {
+            // after the IV and the ciphertext, which is as long as the input
+            ok = pwrite_all(pipe.out, computed, GCM_TAG_LEN, iv_len + pipe.len);
+            if (!ok) perror(tmp_path);
+        } else if (!aes_gcm_tags_equal(computed, tag)) {
+            fprintf(stderr, "authentication failed\n");
+            ok = false;
+        }
+    }
+    close(pipe.in);
+    if (pipe.out >= 0) {
+        if (close(pipe.out) != 0) {
+            perror(tmp_path);
+            ok = false;
+        }
+        if (ok && rename(tmp_path, out_path) != 0) {
+            perror(out_path);
+            ok = false;
+        }
+        // nothing unauthenticated or partial stays behind
+        if (!ok) unlink(tmp_path);
+    }
+    if (ok) {
+        printf("%s %llu bytes in %.3f s, %.2f GB/s\n", encrypt ? "encrypted" : "decrypted",
+               (unsigned long long)(encrypt ? pipe.len : pipe.written), elapsed, (double)pipe.len / elapsed * 1e-9);
+    }
+    free(tmp_path);
+    free(cipher);
+    return ok ? 0 : 1;
+}
+
+#define KEYS_BENCH_KEYS 4096
+#define KEYS_BENCH_MESSAGES (1<<19)
+#define KEYS_BENCH_MESSAGE_BLOCKS 4
+#define KEY_CACHE_DEFAULT_CAPACITY 1024
+
+// Short CTR messages under session keys drawn with a skew towards the
+// first ones, expanding every key and through a cache. The outputs are
+// compared and the hit rate and message rates reported
+static int task_keys(const AesBackend* backend, size_t capacity) {
+    uint32_t random_state = 42;
+    uint32_t (*keys)[8] = (uint32_t (*)[8])malloc(KEYS_BENCH_KEYS * sizeof(*keys));
+    uint32_t* picks = (uint32_t*)malloc(KEYS_BENCH_MESSAGES * sizeof(uint32_t));
+    KeyCache cache;
+    if (keys == NULL || picks == NULL || !key_cache_init(&cache, backend, capacity)) {
+        fprintf(stderr, "out of memory\n");
+        free(keys);
+        free(picks);
+        return 1;
+    }
+    for (size_t k = 0; k < KEYS_BENCH_KEYS; k++) {
+        for (size_t i = 0; i < 8; i++) keys[k][i] = xorshift_next(&random_state);
+    }
+    for (size_t m = 0; m < KEYS_BENCH_MESSAGES; m++) {
+        uint64_t a = xorshift_next(&random_state) % KEYS_BENCH_KEYS;
+        uint64_t b = xorshift_next(&random_state) % KEYS_BENCH_KEYS;
+        picks[m] = (uint32_t)(a * b / KEYS_BENCH_KEYS);
+    }
+    uint64_t checksums[2] = {0};
+    double elapsed[2];
+    for (int cached = 0; cached < 2; cached++) {
+        double start = time_now();
+        for (size_t m = 0; m < KEYS_BENCH_MESSAGES; m++) {
+            const uint32_t* key = keys[picks[m]];
+            // 128, 192 and 256-bit keys
+            size_t key_len = 4 + 2 * (picks[m] % 3);
+            AesKeySchedule local;
+            const AesKeySchedule* schedule = &local;
+            if (cached) {
+                schedule = key_cache_get(&cache, key, key_len);
+            } else {
+                aes_key_schedule_init(&local, backend, key, key_len);
+            }
+            Block blocks[KEYS_BENCH_MESSAGE_BLOCKS] = {0};
+            for (size_t i = 0; i < KEYS_BENCH_MESSAGE_BLOCKS; i++) blocks[i].w[0] = (uint32_t)(m * KEYS_BENCH_MESSAGE_BLOCKS + i);
+            backend_cipher_blocks(backend, blocks, KEYS_BENCH_MESSAGE_BLOCKS, schedule->enc, schedule->rounds);
+            Block check = blocks[0];
+            backend->decipher_block(&check, schedule->dec, schedule->rounds);
+            checksums[cached] = checksums[cached] * 31 + blocks[KEYS_BENCH_MESSAGE_BLOCKS - 1].w[0] + check.w[0];
+        }
+        elapsed[cached] = time_now() - start;
+    }
+    bool ok = checksums[0] == checksums[1];
+    printf("%zu keys, %d messages of %d blocks, cache of %zu entries (%zu bytes each)\n",
+           (size_t)KEYS_BENCH_KEYS, KEYS_BENCH_MESSAGES, KEYS_BENCH_MESSAGE_BLOCKS, capacity, sizeof(KeyCacheEntry));
+    printf("hit rate %.2f%% (%llu hits, %llu misses)\n", key_cache_hit_rate(&cache) * 100.,
+           (unsigned long long)cache.hits, (unsigned long long)cache.misses);
+    printf("expanding every key\t%.2fM messages/s\n", KEYS_BENCH_MESSAGES / elapsed[0] * 1e-6);
+    printf("through the cache\t%.2fM messages/s\n", KEYS_BENCH_MESSAGES / elapsed[1] * 1e-6);
+    printf("outputs %s\n", ok ? "OK" : "MISMATCH");
+    key_cache_free(&cache);
+    free(keys);
+    free(picks);
+    return ok ? 0 : 1;
+}
+
+#define USAGE \
+    "usage: lab2 [-b backend] [vectors|bench]\n" \
+    "       lab2 [-b backend] avalanche [tests] [threads]\n" \
+    "       lab2 [-b backend] sac <samples> <matrices.csv> [threads]\n" \
+    "       lab2 ctr [threads]\n" \
+    "       lab2 gcm\n" \
+    "       lab2 [-b backend] keys [cache entries]\n" \
+    "       lab2 [-b backend] encrypt|decrypt ctr|cbc|gcm <key hex> <in> <out> [threads]\n" \
+    "       without a task runs the avalanche experiment with %d tests\n" \
+    "       -b picks the backend for it (the fastest the CPU runs by default)\n"
+
+static void print_usage() {
+    printf(USAGE, NUM_TESTS);
+    printf("       backends:");
+    for (size_t i = 0; i < AES_BACKENDS_COUNT; i++) {
+        printf(" %s", AES_BACKENDS[i].name);
+    }
+    putchar('\n');
+}
+
+#ifndef LAB2_NOMAIN
+int main(int argc, const char** argv) {
+    //display_tables();
+    const AesBackend* backend = best_backend();
+    if (argc > 2 && strcmp(argv[1], "-b") == 0) {
+        backend = find_backend(argv[2]);
+        if (backend == NULL) {
+            print_usage();
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1 && strcmp(argv[1], "vectors") == 0) {
+        bool ok = true;
+        for (size_t i = 0; i < AES_BACKENDS_COUNT; i++) {
+            if (!backend_supported(&AES_BACKENDS[i])) continue;
+            ok = show_test_vectors(&AES_BACKENDS[i]) && ok;
+            ok = check_random_vectors(&AES_BACKENDS[i]) && ok;
+        }
+        ok = check_key_batch() && ok;
+        return ok ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "ctr") == 0) {
+        size_t threads = argc > 2 ? (size_t)atoi(argv[2]) : 1;
+        if (threads < 1 || threads > MAX_WORKERS) {
+            print_usage();
+            return 1;
+        }
+        return task_ctr(threads);
+    }
+    if (argc > 5 && (strcmp(argv[1], "encrypt") == 0 || strcmp(argv[1], "decrypt") == 0)) {
+        FileMode mode;
+        if (strcmp(argv[2], "ctr") == 0) {
+            mode = FILE_CTR;
+        } else if (strcmp(argv[2], "cbc") == 0) {
+            mode = FILE_CBC;
+        } else if (strcmp(argv[2], "gcm") == 0) {
+            mode = FILE_GCM;
+        } else {
+            print_usage();
+            return 1;
+        }
+        size_t threads = argc > 6 ? (size_t)atoi(argv[6]) : 1;
+        if (threads < 1 || threads > MAX_WORKERS) {
+            print_usage();
+            return 1;
+        }
+        return task_file(backend, strcmp(argv[1], "encrypt") == 0, mode, argv[3], argv[4], argv[5], threads);
+    }
+    if (argc > 1 && strcmp(argv[1], "keys") == 0) {
+        int capacity = argc > 2 ? atoi(argv[2]) : KEY_CACHE_DEFAULT_CAPACITY;
+        if (capacity < 1) {
+            print_usage();
+            return 1;
+        }
+        return task_keys(backend, (size_t)capacity);
+    }
+    if (argc > 1 && strcmp(argv[1], "gcm") == 0) {
+        return task_gcm();
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench_backends();
+        bench_key_expansion();
+        bench_batches();
+        return 0;
+    }
+    if (argc > 3 && strcmp(argv[1], "sac") == 0) {
+        uint64_t samples = strtoull(argv[2], NULL, 10);
+        size_t threads = argc > 4 ? (size_t)atoi(argv[4]) : 1;
+        if (samples < 1 || samples > AVALANCHE_MAX_TESTS || threads < 1 || threads > MAX_WORKERS) {
+            print_usage();
+            return 1;
+        }
+        return task_sac(backend, samples, threads, argv[3]);
+    }
+    uint64_t tests = NUM_TESTS;
+    size_t threads = 1;
+    if (argc > 1 && strcmp(argv[1], "avalanche") == 0) {
+        tests = argc > 2 ? strtoull(argv[2], NULL, 10) : NUM_TESTS;
+        threads = argc > 3 ? (size_t)atoi(argv[3]) : 1;
+        if (tests < 1 || tests > AVALANCHE_MAX_TESTS || threads < 1 || threads > MAX_WORKERS) {
+            print_usage();
+            return 1;
+        }
+    } else if (argc > 1) {
+        print_usage();
+        return 1;
+    }
+    return lab_task(backend, tests, threads);
 }
 #endif//LAB2_NOMAIN